@@ -0,0 +1,95 @@
+#include "arena.h"
+#include "utils.h"
+
+#define ARENA_CHUNK 65536
+#define ARENA_ALIGN 16
+/* requests bigger than this get a chunk of their own instead of
+   abandoning the rest of the current one */
+#define ARENA_LARGE (ARENA_CHUNK / 4)
+
+typedef struct ArenaChunk {
+    struct ArenaChunk *next;
+    int size;
+    int used;
+} ArenaChunk;
+
+#define ARENA_ROUND(n) (((n) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+#define CHUNK_DATA(c) ((char *)(c) + ARENA_ROUND((int)sizeof(ArenaChunk)))
+
+static ArenaChunk *first = 0;    /* survives req_reset() */
+static ArenaChunk *current = 0;  /* chunk small allocations bump from */
+static ArenaChunk *extra = 0;    /* everything else, freed on reset */
+static char *top = 0;            /* latest allocation in `current` */
+
+static ArenaChunk *chunk_new(int size) {
+    ArenaChunk *c = (ArenaChunk *)u_malloc(ARENA_ROUND((int)sizeof(ArenaChunk)) + size);
+    c->next = 0;
+    c->size = size;
+    c->used = 0;
+    return c;
+}
+
+void *req_alloc(int size) {
+    int n = ARENA_ROUND(size > 0 ? size : 1);
+    char *p;
+    if (!first) {
+        first = chunk_new(ARENA_CHUNK);
+        current = first;
+    }
+    if (current->size - current->used < n) {
+        ArenaChunk *c;
+        if (n > ARENA_LARGE) {
+            c = chunk_new(n);
+            c->used = n;
+            c->next = extra;
+            extra = c;
+            return CHUNK_DATA(c);
+        }
+        c = chunk_new(ARENA_CHUNK);
+        c->next = extra;
+        extra = c;
+        current = c;
+    }
+    p = CHUNK_DATA(current) + current->used;
+    current->used += n;
+    top = p;
+    return p;
+}
+
+void *req_realloc(void *p, int old_size, int new_size) {
+    char *np;
+    if (!p) return req_alloc(new_size);
+    if ((char *)p == top) {
+        int off = (int)(top - CHUNK_DATA(current));
+        int n = ARENA_ROUND(new_size > 0 ? new_size : 1);
+        if (off + n <= current->size) {
+            current->used = off + n;
+            return p;
+        }
+    }
+    np = (char *)req_alloc(new_size);
+    u_memcpy(np, p, old_size < new_size ? old_size : new_size);
+    return np;
+}
+
+char *req_strndup(const char *s, int n) {
+    char *out = (char *)req_alloc(n + 1);
+    u_memcpy(out, s, n);
+    out[n] = 0;
+    return out;
+}
+
+char *req_strdup(const char *s) {
+    return req_strndup(s, u_strlen(s));
+}
+
+void req_reset() {
+    while (extra) {
+        ArenaChunk *next = extra->next;
+        u_free(extra);
+        extra = next;
+    }
+    if (first) first->used = 0;
+    current = first;
+    top = 0;
+}
@@ -0,0 +1,22 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+/*
+ * Request arena: a bump allocator for everything that lives only as long
+ * as one request (command output, error text, suggestion lists, the cwd
+ * string, scratch buffers). Allocation is a pointer bump; nothing is
+ * freed individually. protocol_handle() releases it all with req_reset()
+ * once the reply has been written. Long-lived data (the virtual
+ * filesystem, history, undo records, variables) stays on the heap.
+ */
+
+void *req_alloc(int size);
+char *req_strdup(const char *s);
+char *req_strndup(const char *s, int n);
+/* Grow a block from req_alloc to new_size bytes, keeping its contents.
+   The most recent allocation grows in place when the chunk has room. */
+void *req_realloc(void *p, int old_size, int new_size);
+/* Release every request allocation. The first chunk is kept for reuse. */
+void req_reset();
+
+#endif
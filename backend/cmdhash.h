@@ -0,0 +1,19 @@
+#ifndef CMDHASH_H
+#define CMDHASH_H
+
+/*
+ * Seeded FNV-1a over a command name. tools/gen_cmdhash picks a seed
+ * for which every registered name lands in its own slot of a small
+ * power-of-two table (backend/cmdtable.h); commands.c hashes with the
+ * same function, so a lookup is one hash, one slot read, one compare.
+ */
+static unsigned int cmdhash(const char *s, unsigned int seed) {
+    unsigned int h = 2166136261u ^ seed;
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    return h ^ (h >> 15);
+}
+
+#endif
@@ -1,131 +1,175 @@
 #include <stdio.h>
 #include "commands.h"
+#include "arena.h"
+#include "cmdhash.h"
+#include "cmdtable.h"
 #include "filesystem.h"
 #include "history.h"
+#include "script.h"
+#include "stats.h"
 #include "utils.h"
 
-static OpStack undo_stack;
-static OpStack redo_stack;
-static HashMap vars;
-static LogQueue logger_q;
-static TrieNode *trie_root = 0;
+static CommandState *cs = 0;
+static TrieNode *trie_root = 0;  /* shared by every session */
+static CmdOutputSink out_sink = 0;
+static void *out_sink_user = 0;
+/* Output of the previous pipeline stage, for the one running now */
+static int pipe_has_in = 0;
+static const char *pipe_in = 0;
+static int pipe_in_len = 0;
+
+#define COMMAND(name, min_args, flags, usage_error, help) \
+    static CommandResult cmd_##name(TokenArray *t);
+#include "commands.def"
+#undef COMMAND
+
+static const CommandSpec registry[] = {
+#define COMMAND(name, min_args, flags, usage_error, help) \
+    { #name, cmd_##name, min_args, flags, usage_error, help },
+#include "commands.def"
+#undef COMMAND
+};
+static const int registry_count = (int)(sizeof(registry) / sizeof(registry[0]));
 
 static void cr_init(CommandResult *r) {
     r->status = 0;
     r->stdout_text = 0;
+    r->stdout_len = -1;
     r->stderr_text = 0;
     r->suggestions = 0;
     r->suggestion_count = 0;
+    r->streamed = 0;
 }
 
+/* Result text lives in the request arena, released after the reply */
 static void cr_set_out(CommandResult *r, const char *s) {
-    if (r->stdout_text) u_free(r->stdout_text);
-    r->stdout_text = u_strdup(s ? s : "");
+    r->stdout_text = req_strdup(s ? s : "");
+    r->stdout_len = -1;
 }
 
 static void cr_set_err(CommandResult *r, const char *s) {
-    if (r->stderr_text) u_free(r->stderr_text);
-    r->stderr_text = u_strdup(s ? s : "");
+    r->stderr_text = req_strdup(s ? s : "");
+}
+
+static void cr_set_buf(CommandResult *r, UBuffer *b) {
+    r->stdout_text = b->data;
+    r->stdout_len = b->length;
+}
+
+void commands_state_init(CommandState *st) {
+    stack_init(&st->undo_stack);
+    stack_init(&st->redo_stack);
+    hm_init(&st->vars, 32);
+    log_init(&st->logger_q, 50);
+}
+
+void commands_state_free(CommandState *st) {
+    stack_clear(&st->undo_stack);
+    stack_clear(&st->redo_stack);
+    hm_free(&st->vars);
+    log_free(&st->logger_q);
+}
+
+void commands_bind(CommandState *st) {
+    cs = st;
+}
+
+HashMap *commands_vars() {
+    return &cs->vars;
 }
 
 void commands_init() {
-    stack_init(&undo_stack);
-    stack_init(&redo_stack);
-    hm_init(&vars, 128);
-    log_init(&logger_q, 50);
+    int i;
     trie_root = trie_create();
-
-    /* Seed commands */
-    trie_insert(trie_root, "mkdir");
-    trie_insert(trie_root, "ls");
-    trie_insert(trie_root, "cd");
-    trie_insert(trie_root, "touch");
-    trie_insert(trie_root, "write");
-    trie_insert(trie_root, "read");
-    trie_insert(trie_root, "rm");
-    trie_insert(trie_root, "rmdir");
-    trie_insert(trie_root, "cat");
-    trie_insert(trie_root, "pwd");
-    trie_insert(trie_root, "set");
-    trie_insert(trie_root, "get");
-    trie_insert(trie_root, "unset");
-    trie_insert(trie_root, "listenv");
-    trie_insert(trie_root, "history");
-    trie_insert(trie_root, "undo");
-    trie_insert(trie_root, "redo");
-    trie_insert(trie_root, "search");
-    trie_insert(trie_root, "help");
-    trie_insert(trie_root, "log");
-    trie_insert(trie_root, "chmod");
-    trie_insert(trie_root, "export");
-    trie_insert(trie_root, "import");
-    trie_insert(trie_root, "cp");
-    trie_insert(trie_root, "mv");
-    trie_insert(trie_root, "tree");
-    trie_insert(trie_root, "complete");
-    trie_insert(trie_root, "rename");
-    trie_insert(trie_root, "stat");
-    trie_insert(trie_root, "history_prev");
-    trie_insert(trie_root, "history_next");
-}
-
-/* All command names for Levenshtein suggestions */
-static const char *all_commands[] = {
-    "mkdir", "ls", "cd", "touch", "write", "read", "rm",
-    "rmdir", "cat", "pwd", "cp", "mv", "rename", "stat",
-    "search", "chmod", "set", "get", "unset", "listenv",
-    "undo", "redo", "history", "tree", "export", "import", "help",
-    "complete", "log", "history_prev", "history_next"
-};
-static const int all_commands_count = 31;
-
-/* Simple help text */
-static const char *help_text[] = {
-    "mkdir <dir> - create directory",
-    "ls [path] - list directory",
-    "cd <path> - change directory",
-    "touch <file> - create empty file",
-    "write <file> <text> - write text to file",
-    "read <file> - read file content",
-    "rm <file> - delete file",
-    "rmdir <dir> - delete empty directory",
-    "cat <file> - show file with line numbers",
-    "pwd - print working directory",
-    "set <k> <v> - set variable",
-    "get <k> - get variable",
-    "unset <k> - remove variable",
-    "listenv - list variables",
-    "history - show command history",
-    "undo - undo last operation",
-    "redo - redo last undone operation",
-    "search <path> <keyword> - search in files",
-    "help [cmd] - show help",
-    "log - show logs",
-    "chmod <path> <r> <w> - set perms",
-    "export <file> - export state",
-    "import <file> - import state",
-    "complete <prefix> - autocomplete",
-    "rename <old> <new> - rename file or directory",
-    "stat <path> - show file/directory metadata",
-    "history_prev - get previous history entry",
-    "history_next - get next history entry"
-};
+    for (i = 0; i < registry_count; i++) {
+        trie_insert(trie_root, registry[i].name);
+    }
+}
 
 static void append_line(UBuffer *b, const char *s) {
     ubuf_append_str(b, s);
     ubuf_append_char(b, '\n');
 }
 
+const CommandSpec *commands_lookup(const char *name) {
+    int i = cmd_hash_slots[cmdhash(name, CMD_HASH_SEED) & (CMD_HASH_SIZE - 1)];
+    if (i < 0 || u_strcmp(registry[i].name, name) != 0) return 0;
+    return &registry[i];
+}
+
+void commands_set_sink(CmdOutputSink sink, void *user) {
+    out_sink = sink;
+    out_sink_user = user;
+}
+
+/* Output builder for commands whose result can be large. Without a sink
+   it simply collects stdout; with one, every CMD_OUT_CHUNK bytes are
+   handed over as soon as they exist, so memory use stays bounded. */
+
+#define CMD_OUT_CHUNK 32768
+
+typedef struct {
+    UBuffer b;
+    int streamed;
+} CmdOut;
+
+static void out_init(CmdOut *o) {
+    ubuf_init_temp(&o->b);
+    o->streamed = 0;
+}
+
+static void out_flush(CmdOut *o) {
+    if (o->b.length == 0) return;
+    out_sink(o->b.data, o->b.length, out_sink_user);
+    o->b.length = 0;
+    o->b.data[0] = 0;
+    o->streamed = 1;
+}
+
+static void out_mem(CmdOut *o, const char *s, int n) {
+    if (!out_sink) {
+        ubuf_append_mem(&o->b, s, n);
+        return;
+    }
+    while (n > 0) {
+        int room = CMD_OUT_CHUNK - o->b.length;
+        int take = n < room ? n : room;
+        ubuf_append_mem(&o->b, s, take);
+        s += take;
+        n -= take;
+        if (o->b.length >= CMD_OUT_CHUNK) out_flush(o);
+    }
+}
+
+static void out_str(CmdOut *o, const char *s) {
+    out_mem(o, s, u_strlen(s));
+}
+
+static void out_char(CmdOut *o, char c) {
+    out_mem(o, &c, 1);
+}
+
+static void out_line(CmdOut *o, const char *s) {
+    out_str(o, s);
+    out_char(o, '\n');
+}
+
+/* Hand the collected output to the result (no copy), or finish the stream */
+static void out_finish(CmdOut *o, CommandResult *r) {
+    if (o->streamed) {
+        out_flush(o);
+        r->streamed = 1;
+        cr_set_out(r, "");
+    } else {
+        cr_set_buf(r, &o->b);
+    }
+}
+
 /* Filesystem commands */
 
 static CommandResult cmd_mkdir(TokenArray *t) {
     CommandResult r;
     cr_init(&r);
-    if (t->count < 2) {
-        r.status = 1;
-        cr_set_err(&r, "mkdir: missing operand");
-        return r;
-    }
     if (fs_mkdir(t->items[1]) != 0) {
         r.status = 1;
         cr_set_err(&r, "mkdir: cannot create directory");
@@ -138,8 +182,10 @@ static CommandResult cmd_mkdir(TokenArray *t) {
             op.path = u_strdup(t->items[1]);
             op.old_content = 0;
             op.new_content = 0;
-            stack_push(&undo_stack, op);
-            stack_clear(&redo_stack);
+            content_init(&op.old_file);
+            content_init(&op.new_file);
+            stack_push(&cs->undo_stack, op);
+            stack_clear(&cs->redo_stack);
         }
     }
     return r;
@@ -157,13 +203,11 @@ static CommandResult cmd_ls(TokenArray *t) {
         cr_set_err(&r, "ls: cannot access");
         return r;
     }
-    ubuf_init(&b);
+    ubuf_init_temp(&b);
     for (i = 0; i < count; i++) {
         append_line(&b, names[i]);
-        u_free(names[i]);
     }
-    if (names) u_free(names);
-    r.stdout_text = ubuf_to_string(&b);
+    cr_set_buf(&r, &b);
     return r;
 }
 
@@ -187,11 +231,6 @@ static CommandResult cmd_cd(TokenArray *t) {
 static CommandResult cmd_touch(TokenArray *t) {
     CommandResult r;
     cr_init(&r);
-    if (t->count < 2) {
-        r.status = 1;
-        cr_set_err(&r, "touch: missing file");
-        return r;
-    }
     if (fs_touch(t->items[1]) != 0) {
         r.status = 1;
         cr_set_err(&r, "touch: cannot create file");
@@ -203,13 +242,11 @@ static CommandResult cmd_touch(TokenArray *t) {
             if (ext) {
                 if (!u_is_valid_extension(ext)) {
                     UBuffer warn;
-                    ubuf_init(&warn);
+                    ubuf_init_temp(&warn);
                     ubuf_append_str(&warn, "Warning: Unrecognized file extension: .");
                     ubuf_append_str(&warn, ext);
-                    cr_set_err(&r, ubuf_to_string(&warn));
-                    ubuf_free(&warn);
+                    r.stderr_text = warn.data;
                 }
-                u_free(ext);
             }
         }
         {
@@ -218,112 +255,189 @@ static CommandResult cmd_touch(TokenArray *t) {
             op.path = u_strdup(t->items[1]);
             op.old_content = 0;
             op.new_content = 0;
-            stack_push(&undo_stack, op);
-            stack_clear(&redo_stack);
+            content_init(&op.old_file);
+            content_init(&op.new_file);
+            stack_push(&cs->undo_stack, op);
+            stack_clear(&cs->redo_stack);
         }
     }
     return r;
 }
 
+/* A non-negative decimal count, or -1 if s is not one */
+static int parse_count(const char *s) {
+    int v = 0;
+    int i;
+    if (!s[0]) return -1;
+    for (i = 0; s[i] != 0; i++) {
+        if (s[i] < '0' || s[i] > '9' || v > 100000000) return -1;
+        v = v * 10 + (s[i] - '0');
+    }
+    return v;
+}
+
+/* Undo record for a file whose content went from old (a snapshot, which
+   the record takes over) to its current one. Both sides share chunks with
+   the file, so this costs nothing until the file is written again. */
+static void push_write_op(const char *path, Content *old) {
+    Operation op;
+    op.type = OP_WRITE_FILE;
+    op.path = u_strdup(path);
+    op.old_content = 0;
+    op.new_content = 0;
+    op.old_file = *old;
+    content_init(old);
+    content_init(&op.new_file);
+    fs_snapshot(path, &op.new_file);
+    stack_push(&cs->undo_stack, op);
+    stack_clear(&cs->redo_stack);
+}
+
+/* write [--at N | --insert N] <file> <text...> */
 static CommandResult cmd_write(TokenArray *t) {
     CommandResult r;
     cr_init(&r);
-    if (t->count < 3) {
-        r.status = 1;
-        cr_set_err(&r, "write: need file and text");
-        return r;
-    }
     {
-        char *old = fs_read(t->items[1]);
+        int arg = 1;
+        int off = -1;
+        int insert = 0;
+        Content old;
         UBuffer b;
         int i;
-        ubuf_init(&b);
-        for (i = 2; i < t->count; i++) {
-            if (i > 2) ubuf_append_char(&b, ' ');
-            ubuf_append_str(&b, t->items[i]);
-        }
-        {
-            char *text = ubuf_to_string(&b);
-            if (fs_write(t->items[1], text, 0) != 0) {
+        int rc;
+        if (u_strcmp(t->items[1], "--at") == 0 || u_strcmp(t->items[1], "--insert") == 0) {
+            insert = t->items[1][2] == 'i';
+            off = t->count > 2 ? parse_count(t->items[2]) : -1;
+            if (off < 0) {
                 r.status = 1;
-                cr_set_err(&r, "write: failed");
-                u_free(text);
-                if (old) u_free(old);
+                cr_set_err(&r, "write: bad offset");
                 return r;
             }
-            {
-                Operation op;
-                op.type = OP_WRITE_FILE;
-                op.path = u_strdup(t->items[1]);
-                op.old_content = old ? u_strdup(old) : u_strdup("");
-                op.new_content = u_strdup(text);
-                stack_push(&undo_stack, op);
-                stack_clear(&redo_stack);
+            arg = 3;
+            if (t->count <= arg || (t->count == arg + 1 && !pipe_has_in)) {
+                r.status = 1;
+                cr_set_err(&r, "write: need file and text");
+                return r;
             }
-            u_free(text);
         }
-        if (old) u_free(old);
+        content_init(&old);
+        fs_snapshot(t->items[arg], &old);
+        ubuf_init_temp(&b);
+        if (t->count < arg + 2) {
+            ubuf_append_mem(&b, pipe_in, pipe_in_len);
+        }
+        for (i = arg + 1; i < t->count; i++) {
+            if (i > arg + 1) ubuf_append_char(&b, ' ');
+            ubuf_append_str(&b, t->items[i]);
+        }
+        if (off < 0) {
+            rc = fs_write_mem(t->items[arg], b.data, b.length, 0);
+        } else {
+            rc = fs_write_at(t->items[arg], off, b.data, b.length, insert);
+        }
+        if (rc != 0) {
+            content_free(&old);
+            r.status = 1;
+            cr_set_err(&r, rc == -3 ? "write: offset past end of file" : "write: failed");
+            return r;
+        }
+        push_write_op(t->items[arg], &old);
         cr_set_out(&r, "");
     }
     return r;
 }
 
+static CommandResult cmd_truncate(TokenArray *t) {
+    CommandResult r;
+    Content old;
+    int size = parse_count(t->items[2]);
+    int rc;
+    cr_init(&r);
+    if (size < 0) {
+        r.status = 1;
+        cr_set_err(&r, "truncate: bad size");
+        return r;
+    }
+    content_init(&old);
+    fs_snapshot(t->items[1], &old);
+    rc = fs_truncate(t->items[1], size);
+    if (rc != 0) {
+        content_free(&old);
+        r.status = 1;
+        cr_set_err(&r, rc == -3 ? "truncate: size past end of file" : "truncate: cannot write");
+        return r;
+    }
+    push_write_op(t->items[1], &old);
+    cr_set_out(&r, "");
+    return r;
+}
+
+/* Readable file node for path, or 0 (same rules as fs_read) */
+static TreeNode *readable_file(const char *path) {
+    TreeNode *f = fs_find_node(path);
+    if (!f || f->type != NODE_FILE || !f->perms_read) return 0;
+    return f;
+}
+
 static CommandResult cmd_read(TokenArray *t) {
     CommandResult r;
-    char *c;
+    TreeNode *f;
     cr_init(&r);
     if (t->count < 2) {
-        r.status = 1;
-        cr_set_err(&r, "read: missing file");
+        CmdOut o;
+        out_init(&o);
+        out_mem(&o, pipe_in, pipe_in_len);
+        out_finish(&o, &r);
         return r;
     }
-    c = fs_read(t->items[1]);
-    if (!c) {
+    f = readable_file(t->items[1]);
+    if (!f) {
         r.status = 1;
         cr_set_err(&r, "read: cannot read");
     } else {
-        r.stdout_text = c;
+        CmdOut o;
+        int k;
+        out_init(&o);
+        for (k = 0; k < f->u.file.count; k++) {
+            const char *data;
+            int len = content_chunk(&f->u.file, k, &data);
+            out_mem(&o, data, len);
+        }
+        out_finish(&o, &r);
     }
     return r;
 }
 
 static CommandResult cmd_rm(TokenArray *t) {
     CommandResult r;
+    Content old;
     cr_init(&r);
-    if (t->count < 2) {
-        r.status = 1;
-        cr_set_err(&r, "rm: missing file");
-        return r;
-    }
-    char *old = fs_read(t->items[1]);
+    content_init(&old);
+    fs_snapshot(t->items[1], &old);
     if (fs_rm(t->items[1]) != 0) {
+        content_free(&old);
         r.status = 1;
         cr_set_err(&r, "rm: cannot remove");
-        if (old) u_free(old);
     } else {
         cr_set_out(&r, "");
         {
             Operation op;
             op.type = OP_DELETE_FILE;
             op.path = u_strdup(t->items[1]);
-            op.old_content = old ? u_strdup(old) : 0;
+            op.old_content = 0;
             op.new_content = 0;
-            stack_push(&undo_stack, op);
-            stack_clear(&redo_stack);
+            op.old_file = old;
+            content_init(&op.new_file);
+            stack_push(&cs->undo_stack, op);
+            stack_clear(&cs->redo_stack);
         }
     }
-    if (old) u_free(old);
     return r;
 }
 
 static CommandResult cmd_rmdir(TokenArray *t) {
     CommandResult r;
     cr_init(&r);
-    if (t->count < 2) {
-        r.status = 1;
-        cr_set_err(&r, "rmdir: missing dir");
-        return r;
-    }
     if (fs_rmdir(t->items[1]) != 0) {
         r.status = 1;
         cr_set_err(&r, "rmdir: cannot remove");
@@ -342,56 +456,211 @@ static CommandResult cmd_pwd(TokenArray *t) {
     return r;
 }
 
+/* Copy size bytes of a numbered listing, whole lines at once, numbering
+   the line after each '\n'; *line is the number of the line in progress */
+static void cat_numbered_part(CmdOut *o, const char *c, int size, int *line) {
+    int i;
+    int run = 0;
+    char num[32];
+    for (i = 0; i < size; i++) {
+        if (c[i] == '\n') {
+            out_mem(o, c + run, i + 1 - run);
+            run = i + 1;
+            (*line)++;
+            u_itoa(*line, num);
+            out_str(o, num);
+            out_str(o, ": ");
+        }
+    }
+    out_mem(o, c + run, size - run);
+}
+
+/* Numbered listing of c, whose first line is line number `first` */
+static void cat_numbered(CmdOut *o, const char *c, int size, int first) {
+    char num[32];
+    u_itoa(first, num);
+    out_str(o, num);
+    out_str(o, ": ");
+    cat_numbered_part(o, c, size, &first);
+}
+
+/* Numbered listing of a line range cut from a larger text: nothing when
+   it is empty, and no number for a line after its final newline */
+static void cat_numbered_range(CmdOut *o, const char *c, int size, int first) {
+    if (size == 0) return;
+    if (c[size - 1] == '\n') {
+        cat_numbered(o, c, size - 1, first);
+        out_char(o, '\n');
+    } else {
+        cat_numbered(o, c, size, first);
+    }
+}
+
+/* Offset of 1-based line `line` in s, as content_line_start */
+static int mem_line_start(const char *s, int len, int line) {
+    int seen = 0;
+    int i;
+    if (line <= 1) return 0;
+    for (i = 0; i < len; i++) {
+        if (s[i] == '\n' && ++seen == line - 1) return i + 1;
+    }
+    return -1;
+}
+
+/* Offset where the last n lines of s start, as content_tail_start */
+static int mem_tail_start(const char *s, int len, int n) {
+    int seen = 0;
+    int i;
+    if (n <= 0) return len;
+    if (len > 0 && s[len - 1] == '\n') len--;
+    for (i = len - 1; i >= 0; i--) {
+        if (s[i] == '\n' && ++seen == n) return i + 1;
+    }
+    return 0;
+}
+
+/* "a:b", "a:" or ":b" (1-based, inclusive) into *first and *last, with
+   *last -1 for an open end; returns -1 if malformed */
+static int parse_line_range(const char *s, int *first, int *last) {
+    int colon = u_find_char(s, ':');
+    char num[32];
+    if (colon < 0 || colon >= (int)sizeof(num)) return -1;
+    u_memcpy(num, s, colon);
+    num[colon] = 0;
+    *first = colon == 0 ? 1 : parse_count(num);
+    *last = s[colon + 1] == 0 ? -1 : parse_count(s + colon + 1);
+    if (*first < 1 || (s[colon + 1] != 0 && *last < 0)) return -1;
+    return 0;
+}
+
+/* cat [--lines a:b] <file> */
 static CommandResult cmd_cat(TokenArray *t) {
     CommandResult r;
-    char *c;
+    TreeNode *f;
+    CmdOut o;
+    int arg = 1;
+    int first = 1;
+    int last = -1;
     cr_init(&r);
-    if (t->count < 2) {
-        r.status = 1;
-        cr_set_err(&r, "cat: missing file");
+    if (t->count > 1 && u_strcmp(t->items[1], "--lines") == 0) {
+        if (t->count < 3 || parse_line_range(t->items[2], &first, &last) != 0) {
+            r.status = 1;
+            cr_set_err(&r, "cat: bad line range (want a:b)");
+            return r;
+        }
+        arg = 3;
+    }
+    if (t->count <= arg) {
+        int start = mem_line_start(pipe_in, pipe_in_len, first);
+        int end = last < 0 ? -1 : mem_line_start(pipe_in, pipe_in_len, last + 1);
+        if (!pipe_has_in) {
+            r.status = 1;
+            cr_set_err(&r, "cat: missing file");
+            return r;
+        }
+        if (end < 0) end = pipe_in_len;
+        out_init(&o);
+        if (arg == 1) {
+            cat_numbered(&o, pipe_in, pipe_in_len, 1);
+        } else if (start >= 0 && start < end) {
+            cat_numbered_range(&o, pipe_in + start, end - start, first);
+        }
+        out_finish(&o, &r);
+        return r;
+    }
+    if (arg > 1) {
+        int len;
+        char *text = fs_read_lines(t->items[arg], first, last, &len);
+        if (!text) {
+            r.status = 1;
+            cr_set_err(&r, "cat: cannot read");
+            return r;
+        }
+        out_init(&o);
+        cat_numbered_range(&o, text, len, first);
+        out_finish(&o, &r);
         return r;
     }
-    c = fs_read(t->items[1]);
-    if (!c) {
+    f = readable_file(t->items[arg]);
+    if (!f) {
         r.status = 1;
         cr_set_err(&r, "cat: cannot read");
     } else {
-        UBuffer b;
-        int i = 0;
         int line = 1;
-        char num[32];
-        ubuf_init(&b);
-        u_itoa(line, num);
-        ubuf_append_str(&b, num);
-        ubuf_append_str(&b, ": ");
-        while (c[i] != 0) {
-            char ch = c[i];
-            ubuf_append_char(&b, ch);
-            if (ch == '\n') {
-                line++;
-                u_itoa(line, num);
-                ubuf_append_str(&b, num);
-                ubuf_append_str(&b, ": ");
-            }
-            i++;
+        int k;
+        out_init(&o);
+        out_str(&o, "1: ");
+        for (k = 0; k < f->u.file.count; k++) {
+            const char *data;
+            int len = content_chunk(&f->u.file, k, &data);
+            cat_numbered_part(&o, data, len, &line);
         }
-        r.stdout_text = ubuf_to_string(&b);
-        u_free(c);
+        out_finish(&o, &r);
     }
     return r;
 }
 
+/* head/tail [-n N] <file>: the first or last N lines, default 10 */
+static CommandResult head_tail(TokenArray *t, int tail) {
+    CommandResult r;
+    CmdOut o;
+    int n = 10;
+    int arg = 1;
+    cr_init(&r);
+    if (t->count > 1 && u_strcmp(t->items[1], "-n") == 0) {
+        n = t->count > 2 ? parse_count(t->items[2]) : -1;
+        if (n < 0) {
+            r.status = 1;
+            cr_set_err(&r, tail ? "tail: bad line count" : "head: bad line count");
+            return r;
+        }
+        arg = 3;
+    }
+    out_init(&o);
+    if (t->count <= arg) {
+        int start = 0;
+        int end = pipe_in_len;
+        if (!pipe_has_in) {
+            r.status = 1;
+            cr_set_err(&r, tail ? "tail: missing file" : "head: missing file");
+            return r;
+        }
+        if (tail) {
+            start = mem_tail_start(pipe_in, pipe_in_len, n);
+        } else {
+            end = mem_line_start(pipe_in, pipe_in_len, n + 1);
+            if (end < 0) end = pipe_in_len;
+        }
+        out_mem(&o, pipe_in + start, end - start);
+    } else {
+        int len;
+        char *text = tail ? fs_read_tail(t->items[arg], n, &len)
+                          : fs_read_lines(t->items[arg], 1, n, &len);
+        if (!text) {
+            r.status = 1;
+            cr_set_err(&r, tail ? "tail: cannot read" : "head: cannot read");
+            return r;
+        }
+        out_mem(&o, text, len);
+    }
+    out_finish(&o, &r);
+    return r;
+}
+
+static CommandResult cmd_head(TokenArray *t) {
+    return head_tail(t, 0);
+}
+
+static CommandResult cmd_tail(TokenArray *t) {
+    return head_tail(t, 1);
+}
+
 /* Variables */
 
 static CommandResult cmd_set(TokenArray *t) {
     CommandResult r;
     cr_init(&r);
-    if (t->count < 3) {
-        r.status = 1;
-        cr_set_err(&r, "set: need key and value");
-        return r;
-    }
-    hm_set(&vars, t->items[1], t->items[2]);
+    hm_set(&cs->vars, t->items[1], t->items[2]);
     cr_set_out(&r, "");
     return r;
 }
@@ -400,12 +669,7 @@ static CommandResult cmd_get(TokenArray *t) {
     CommandResult r;
     char *v;
     cr_init(&r);
-    if (t->count < 2) {
-        r.status = 1;
-        cr_set_err(&r, "get: need key");
-        return r;
-    }
-    v = hm_get(&vars, t->items[1]);
+    v = hm_get(&cs->vars, t->items[1]);
     if (!v) {
         r.status = 1;
         cr_set_err(&r, "get: not found");
@@ -418,12 +682,7 @@ static CommandResult cmd_get(TokenArray *t) {
 static CommandResult cmd_unset(TokenArray *t) {
     CommandResult r;
     cr_init(&r);
-    if (t->count < 2) {
-        r.status = 1;
-        cr_set_err(&r, "unset: need key");
-        return r;
-    }
-    hm_unset(&vars, t->items[1]);
+    hm_unset(&cs->vars, t->items[1]);
     cr_set_out(&r, "");
     return r;
 }
@@ -434,14 +693,12 @@ static CommandResult cmd_listenv(TokenArray *t) {
     int count, i;
     UBuffer b;
     cr_init(&r);
-    hm_list(&vars, &pairs, &count);
-    ubuf_init(&b);
+    hm_list(&cs->vars, &pairs, &count);
+    ubuf_init_temp(&b);
     for (i = 0; i < count; i++) {
         append_line(&b, pairs[i]);
-        u_free(pairs[i]);
     }
-    if (pairs) u_free(pairs);
-    r.stdout_text = ubuf_to_string(&b);
+    cr_set_buf(&r, &b);
     return r;
 }
 
@@ -451,16 +708,14 @@ static CommandResult cmd_history(TokenArray *t) {
     CommandResult r;
     char **lines;
     int count, i;
-    UBuffer b;
+    CmdOut o;
     cr_init(&r);
     history_get_all(&lines, &count);
-    ubuf_init(&b);
+    out_init(&o);
     for (i = 0; i < count; i++) {
-        append_line(&b, lines[i]);
-        u_free(lines[i]);
+        out_line(&o, lines[i]);
     }
-    if (lines) u_free(lines);
-    r.stdout_text = ubuf_to_string(&b);
+    out_finish(&o, &r);
     return r;
 }
 
@@ -470,25 +725,24 @@ static CommandResult cmd_undo(TokenArray *t) {
     CommandResult r;
     Operation op;
     cr_init(&r);
-    if (!stack_pop(&undo_stack, &op)) {
+    if (!stack_pop(&cs->undo_stack, &op)) {
         cr_set_err(&r, "undo: nothing to undo");
         r.status = 1;
         return r;
     }
     if (op.type == OP_WRITE_FILE) {
-        fs_write(op.path, op.old_content, 0);
+        fs_restore(op.path, &op.old_file);
     } else if (op.type == OP_CREATE_FILE) {
         fs_rm(op.path);
     } else if (op.type == OP_CREATE_DIR) {
         fs_rmdir(op.path);
     } else if (op.type == OP_DELETE_FILE) {
-        fs_write(op.path, op.old_content ? op.old_content : "", 0);
+        fs_restore(op.path, &op.old_file);
     } else if (op.type == OP_MOVE) {
         fs_move(op.new_content, op.old_content);
     } else if (op.type == OP_RENAME) {
         /* Construct path with new name to find the renamed node */
         UBuffer path_buf;
-        char *parent_path;
         int path_len = u_strlen(op.path);
         int last_slash = -1;
         int i;
@@ -498,7 +752,7 @@ static CommandResult cmd_undo(TokenArray *t) {
                 break;
             }
         }
-        ubuf_init(&path_buf);
+        ubuf_init_temp(&path_buf);
         if (last_slash <= 0) {
             ubuf_append_char(&path_buf, '/');
         } else {
@@ -508,11 +762,9 @@ static CommandResult cmd_undo(TokenArray *t) {
         }
         ubuf_append_char(&path_buf, '/');
         ubuf_append_str(&path_buf, op.new_content);
-        parent_path = ubuf_to_string(&path_buf);
-        fs_rename(parent_path, op.old_content);
-        u_free(parent_path);
+        fs_rename(path_buf.data, op.old_content);
     }
-    stack_push(&redo_stack, op);
+    stack_push(&cs->redo_stack, op);
     cr_set_out(&r, "");
     return r;
 }
@@ -521,13 +773,13 @@ static CommandResult cmd_redo(TokenArray *t) {
     CommandResult r;
     Operation op;
     cr_init(&r);
-    if (!stack_pop(&redo_stack, &op)) {
+    if (!stack_pop(&cs->redo_stack, &op)) {
         cr_set_err(&r, "redo: nothing to redo");
         r.status = 1;
         return r;
     }
     if (op.type == OP_WRITE_FILE) {
-        fs_write(op.path, op.new_content, 0);
+        fs_restore(op.path, &op.new_file);
     } else if (op.type == OP_CREATE_FILE) {
         fs_touch(op.path);
     } else if (op.type == OP_CREATE_DIR) {
@@ -539,7 +791,6 @@ static CommandResult cmd_redo(TokenArray *t) {
     } else if (op.type == OP_RENAME) {
         /* Construct path with old name to find the node after undo */
         UBuffer path_buf;
-        char *parent_path;
         int path_len = u_strlen(op.path);
         int last_slash = -1;
         int i;
@@ -549,7 +800,7 @@ static CommandResult cmd_redo(TokenArray *t) {
                 break;
             }
         }
-        ubuf_init(&path_buf);
+        ubuf_init_temp(&path_buf);
         if (last_slash <= 0) {
             ubuf_append_char(&path_buf, '/');
         } else {
@@ -559,11 +810,9 @@ static CommandResult cmd_redo(TokenArray *t) {
         }
         ubuf_append_char(&path_buf, '/');
         ubuf_append_str(&path_buf, op.old_content);
-        parent_path = ubuf_to_string(&path_buf);
-        fs_rename(parent_path, op.new_content);
-        u_free(parent_path);
+        fs_rename(path_buf.data, op.new_content);
     }
-    stack_push(&undo_stack, op);
+    stack_push(&cs->undo_stack, op);
     cr_set_out(&r, "");
     return r;
 }
@@ -571,36 +820,63 @@ static CommandResult cmd_redo(TokenArray *t) {
 /* Search */
 
 typedef struct {
-    UBuffer *b;
+    CmdOut *o;
 } SearchCtx;
 
 static void search_cb(const char *path, int line, const char *text, void *user) {
     SearchCtx *ctx = (SearchCtx *)user;
     char num[32];
-    ubuf_append_str(ctx->b, path);
-    ubuf_append_char(ctx->b, ':');
+    out_str(ctx->o, path);
+    out_char(ctx->o, ':');
     u_itoa(line, num);
-    ubuf_append_str(ctx->b, num);
-    ubuf_append_char(ctx->b, ':');
-    ubuf_append_str(ctx->b, text);
-    ubuf_append_char(ctx->b, '\n');
+    out_str(ctx->o, num);
+    out_char(ctx->o, ':');
+    out_line(ctx->o, text);
+}
+
+static int mem_contains(const char *s, int n, const char *kw, int kn) {
+    int i;
+    for (i = 0; i + kn <= n; i++) {
+        if (u_strncmp(s + i, kw, kn) == 0) return 1;
+    }
+    return 0;
+}
+
+/* `search - <keyword>`: the piped lines that contain keyword */
+static void search_piped(CmdOut *o, const char *kw) {
+    int kn = u_strlen(kw);
+    int start = 0;
+    int i;
+    for (i = 0; i <= pipe_in_len; i++) {
+        if (i == pipe_in_len || pipe_in[i] == '\n') {
+            if (i > start && mem_contains(pipe_in + start, i - start, kw, kn)) {
+                out_mem(o, pipe_in + start, i - start);
+                out_char(o, '\n');
+            }
+            start = i + 1;
+        }
+    }
 }
 
 static CommandResult cmd_search(TokenArray *t) {
     CommandResult r;
     cr_init(&r);
-    if (t->count < 3) {
+    if (u_strcmp(t->items[1], "-") == 0 && !pipe_has_in) {
         r.status = 1;
-        cr_set_err(&r, "search: need path and keyword");
+        cr_set_err(&r, "search: - needs piped input");
         return r;
     }
     {
-        UBuffer b;
+        CmdOut o;
         SearchCtx ctx;
-        ubuf_init(&b);
-        ctx.b = &b;
-        fs_search(t->items[1], t->items[2], search_cb, &ctx);
-        r.stdout_text = ubuf_to_string(&b);
+        out_init(&o);
+        if (pipe_has_in && u_strcmp(t->items[1], "-") == 0) {
+            search_piped(&o, t->items[2]);
+        } else {
+            ctx.o = &o;
+            fs_search(t->items[1], t->items[2], search_cb, &ctx);
+        }
+        out_finish(&o, &r);
     }
     return r;
 }
@@ -612,21 +888,13 @@ static CommandResult cmd_help(TokenArray *t) {
     UBuffer b;
     int i;
     cr_init(&r);
-    ubuf_init(&b);
-    if (t->count < 2) {
-        int lines = (int)(sizeof(help_text) / sizeof(help_text[0]));
-        for (i = 0; i < lines; i++) {
-            append_line(&b, help_text[i]);
-        }
-    } else {
-        int lines = (int)(sizeof(help_text) / sizeof(help_text[0]));
-        for (i = 0; i < lines; i++) {
-            if (u_startswith(help_text[i], t->items[1])) {
-                append_line(&b, help_text[i]);
-            }
+    ubuf_init_temp(&b);
+    for (i = 0; i < registry_count; i++) {
+        if (t->count < 2 || u_startswith(registry[i].help, t->items[1])) {
+            append_line(&b, registry[i].help);
         }
     }
-    r.stdout_text = ubuf_to_string(&b);
+    cr_set_buf(&r, &b);
     return r;
 }
 
@@ -638,31 +906,128 @@ static CommandResult cmd_log(TokenArray *t) {
     int count, i;
     UBuffer b;
     cr_init(&r);
-    log_get_all(&logger_q, &entries, &count);
-    ubuf_init(&b);
+    log_get_all(&cs->logger_q, &entries, &count);
+    ubuf_init_temp(&b);
     for (i = 0; i < count; i++) {
         ubuf_append_str(&b, entries[i].timestamp);
         ubuf_append_str(&b, " ");
         ubuf_append_str(&b, entries[i].message);
         ubuf_append_char(&b, '\n');
-        u_free(entries[i].timestamp);
-        u_free(entries[i].message);
     }
-    if (entries) u_free(entries);
-    r.stdout_text = ubuf_to_string(&b);
+    cr_set_buf(&r, &b);
     return r;
 }
 
-/* Permissions (simplified: r w as 0/1 integers) */
+/* Scripts */
 
-static CommandResult cmd_chmod(TokenArray *t) {
+#define SOURCE_MAX_DEPTH 16
+
+static int source_depth = 0;
+
+/*
+ * Runs each line of the compiled script (see script.h) as if it had been
+ * sent on its own, collecting the output. Stops at `exit` or at the first
+ * failing line, which is reported with its line number.
+ */
+static CommandResult cmd_source(TokenArray *t) {
+    CommandResult r;
+    CmdOutputSink sink = out_sink;
+    TreeNode *f;
+    Script *s;
+    CmdOut o;
+    TokenArray dynamic;
+    int failed = -1;
+    int i;
+    CommandResult lr;
+    cr_init(&r);
+    if (source_depth >= SOURCE_MAX_DEPTH) {
+        r.status = 1;
+        cr_set_err(&r, "source: nested too deeply");
+        return r;
+    }
+    f = readable_file(t->items[1]);
+    if (!f) {
+        r.status = 1;
+        cr_set_err(&r, "source: cannot read");
+        return r;
+    }
+    s = script_acquire(f);
+    source_depth++;
+    /* the script's lines do not see input piped into `source` */
+    pipe_has_in = 0;
+    parser_init(&dynamic);
+    out_init(&o);
+    for (i = 0; i < s->line_count; i++) {
+        TokenArray line;
+        int len;
+        if (s->lines[i].text) {
+            parser_tokenize_env(s->lines[i].text, &dynamic, &cs->vars);
+            line = dynamic;
+        } else {
+            script_line_tokens(s, i, &line);
+        }
+        if (line.count == 0) continue;
+        if (line.count == 1 && u_strcmp(line.items[0], "exit") == 0) break;
+        out_sink = 0;
+        lr = cmd_execute(&line);
+        out_sink = sink;
+        if (lr.stdout_text) {
+            len = lr.stdout_len >= 0 ? lr.stdout_len : u_strlen(lr.stdout_text);
+            out_mem(&o, lr.stdout_text, len);
+            if (len > 0 && lr.stdout_text[len - 1] != '\n') out_char(&o, '\n');
+        }
+        if (lr.status != 0) {
+            failed = i;
+            break;
+        }
+    }
+    source_depth--;
+    parser_destroy(&dynamic);
+    out_finish(&o, &r);
+    if (failed >= 0) {
+        UBuffer err;
+        char num[32];
+        ubuf_init_temp(&err);
+        ubuf_append_str(&err, "source: ");
+        ubuf_append_str(&err, t->items[1]);
+        ubuf_append_char(&err, ':');
+        u_itoa(s->lines[failed].line_no, num);
+        ubuf_append_str(&err, num);
+        ubuf_append_str(&err, ": ");
+        ubuf_append_str(&err, lr.stderr_text ? lr.stderr_text : "failed");
+        r.status = 1;
+        r.stderr_text = err.data;
+    }
+    script_release(s);
+    return r;
+}
+
+/* Latency statistics */
+
+static CommandResult cmd_stats(TokenArray *t) {
     CommandResult r;
+    UBuffer b;
     cr_init(&r);
-    if (t->count < 4) {
+    if (t->count >= 2 && u_strcmp(t->items[1], "reset") == 0) {
+        stats_reset();
+        cr_set_out(&r, "");
+        return r;
+    }
+    ubuf_init_temp(&b);
+    if (stats_report(&b, t->count >= 2 ? t->items[1] : 0) != 0) {
         r.status = 1;
-        cr_set_err(&r, "chmod: need path r w");
+        cr_set_err(&r, "stats: no data for that command");
         return r;
     }
+    cr_set_buf(&r, &b);
+    return r;
+}
+
+/* Permissions (simplified: r w as 0/1 integers) */
+
+static CommandResult cmd_chmod(TokenArray *t) {
+    CommandResult r;
+    cr_init(&r);
     {
         int rbit = u_atoi(t->items[2]);
         int wbit = u_atoi(t->items[3]);
@@ -688,11 +1053,6 @@ static CommandResult cmd_chmod(TokenArray *t) {
 static CommandResult cmd_export(TokenArray *t) {
     CommandResult r;
     cr_init(&r);
-    if (t->count < 2) {
-        r.status = 1;
-        cr_set_err(&r, "export: need filename");
-        return r;
-    }
     {
         int st;
         fs_export_to_file(t->items[1], &st);
@@ -709,11 +1069,6 @@ static CommandResult cmd_export(TokenArray *t) {
 static CommandResult cmd_import(TokenArray *t) {
     CommandResult r;
     cr_init(&r);
-    if (t->count < 2) {
-        r.status = 1;
-        cr_set_err(&r, "import: need filename");
-        return r;
-    }
     {
         int st;
         fs_import_from_file(t->items[1], &st);
@@ -729,15 +1084,20 @@ static CommandResult cmd_import(TokenArray *t) {
 
 /* cp, mv, tree, autocomplete */
 
+/* cp [-r] <src> <dst> */
 static CommandResult cmd_cp(TokenArray *t) {
     CommandResult r;
+    int arg = 1;
     cr_init(&r);
-    if (t->count < 3) {
-        r.status = 1;
-        cr_set_err(&r, "cp: need src and dst");
-        return r;
+    if (u_strcmp(t->items[1], "-r") == 0) {
+        arg = 2;
+        if (t->count < 4) {
+            r.status = 1;
+            cr_set_err(&r, "cp: need src and dst");
+            return r;
+        }
     }
-    if (fs_copy(t->items[1], t->items[2]) != 0) {
+    if (fs_copy(t->items[arg], t->items[arg + 1], arg == 2) != 0) {
         r.status = 1;
         cr_set_err(&r, "cp: failed");
     } else {
@@ -749,11 +1109,6 @@ static CommandResult cmd_cp(TokenArray *t) {
 static CommandResult cmd_mv(TokenArray *t) {
     CommandResult r;
     cr_init(&r);
-    if (t->count < 3) {
-        r.status = 1;
-        cr_set_err(&r, "mv: need src and dst");
-        return r;
-    }
     if (fs_move(t->items[1], t->items[2]) != 0) {
         r.status = 1;
         cr_set_err(&r, "mv: failed");
@@ -763,30 +1118,31 @@ static CommandResult cmd_mv(TokenArray *t) {
         op.path = u_strdup(t->items[1]);
         op.old_content = u_strdup(t->items[1]);
         op.new_content = u_strdup(t->items[2]);
-        stack_push(&undo_stack, op);
-        stack_clear(&redo_stack);
+        content_init(&op.old_file);
+        content_init(&op.new_file);
+        stack_push(&cs->undo_stack, op);
+        stack_clear(&cs->redo_stack);
         cr_set_out(&r, "");
     }
     return r;
 }
 
-static void tree_rec(TreeNode *n, const char *prefix, UBuffer *b) {
-    int i;
+static void tree_rec(TreeNode *n, const char *prefix, CmdOut *o) {
+    DirIter it;
+    TreeNode *ch;
     if (n != fs_get_root()) {
-        ubuf_append_str(b, prefix);
-        ubuf_append_str(b, "- ");
-        ubuf_append_str(b, n->name);
-        ubuf_append_char(b, '\n');
+        out_str(o, prefix);
+        out_str(o, "- ");
+        out_line(o, fs_node_name(n));
     }
     if (n->type != NODE_DIR) return;
-    for (i = 0; i < n->child_count; i++) {
-        TreeNode *ch = n->children[i];
+    dt_iter_init(&n->u.dir.children, &it);
+    while ((ch = dt_iter_next(&it)) != 0) {
         UBuffer np;
-        ubuf_init(&np);
+        ubuf_init_temp(&np);
         ubuf_append_str(&np, prefix);
         ubuf_append_str(&np, "  ");
-        tree_rec(ch, np.data, b);
-        ubuf_free(&np);
+        tree_rec(ch, np.data, o);
     }
 }
 
@@ -794,9 +1150,8 @@ static CommandResult cmd_tree(TokenArray *t) {
     CommandResult r;
     cr_init(&r);
     {
-        UBuffer b;
+        CmdOut o;
         TreeNode *start;
-        ubuf_init(&b);
         if (t->count > 1) {
             start = fs_find_node(t->items[1]);
             if (!start) {
@@ -807,8 +1162,9 @@ static CommandResult cmd_tree(TokenArray *t) {
         } else {
             start = fs_get_cwd();
         }
-        tree_rec(start, "", &b);
-        r.stdout_text = ubuf_to_string(&b);
+        out_init(&o);
+        tree_rec(start, "", &o);
+        out_finish(&o, &r);
     }
     return r;
 }
@@ -818,11 +1174,6 @@ static CommandResult cmd_tree(TokenArray *t) {
 static CommandResult cmd_rename(TokenArray *t) {
     CommandResult r;
     cr_init(&r);
-    if (t->count < 3) {
-        r.status = 1;
-        cr_set_err(&r, "rename: need <old> <new>");
-        return r;
-    }
     /* Validate new name doesn't contain / */
     {
         int i;
@@ -842,7 +1193,7 @@ static CommandResult cmd_rename(TokenArray *t) {
             cr_set_err(&r, "rename: path not found");
             return r;
         }
-        old_name = u_strdup(node->name);
+        old_name = u_strdup(fs_node_name(node));
         if (fs_rename(t->items[1], t->items[2]) != 0) {
             r.status = 1;
             cr_set_err(&r, "rename: failed (name may already exist)");
@@ -856,8 +1207,10 @@ static CommandResult cmd_rename(TokenArray *t) {
             op.path = u_strdup(t->items[1]);
             op.old_content = old_name;
             op.new_content = u_strdup(t->items[2]);
-            stack_push(&undo_stack, op);
-            stack_clear(&redo_stack);
+            content_init(&op.old_file);
+            content_init(&op.new_file);
+            stack_push(&cs->undo_stack, op);
+            stack_clear(&cs->redo_stack);
         }
         cr_set_out(&r, "Renamed successfully");
     }
@@ -869,11 +1222,6 @@ static CommandResult cmd_rename(TokenArray *t) {
 static CommandResult cmd_stat(TokenArray *t) {
     CommandResult r;
     cr_init(&r);
-    if (t->count < 2) {
-        r.status = 1;
-        cr_set_err(&r, "stat: need path");
-        return r;
-    }
     {
         TreeNode *node = fs_find_node(t->items[1]);
         UBuffer b;
@@ -883,9 +1231,9 @@ static CommandResult cmd_stat(TokenArray *t) {
             cr_set_err(&r, "stat: path not found");
             return r;
         }
-        ubuf_init(&b);
+        ubuf_init_temp(&b);
         ubuf_append_str(&b, "Name: ");
-        ubuf_append_str(&b, node->name);
+        ubuf_append_str(&b, fs_node_name(node));
         ubuf_append_char(&b, '\n');
         
         ubuf_append_str(&b, "Type: ");
@@ -894,7 +1242,7 @@ static CommandResult cmd_stat(TokenArray *t) {
         
         if (node->type == NODE_FILE) {
             ubuf_append_str(&b, "Size: ");
-            u_itoa(node->content_size, num);
+            u_itoa(node->u.file.size, num);
             ubuf_append_str(&b, num);
             ubuf_append_char(&b, '\n');
             
@@ -907,7 +1255,7 @@ static CommandResult cmd_stat(TokenArray *t) {
             ubuf_append_char(&b, '\n');
         } else {
             ubuf_append_str(&b, "Children: ");
-            u_itoa(node->child_count, num);
+            u_itoa(node->u.dir.count, num);
             ubuf_append_str(&b, num);
             ubuf_append_char(&b, '\n');
         }
@@ -957,7 +1305,7 @@ static CommandResult cmd_stat(TokenArray *t) {
         }
         ubuf_append_char(&b, '\n');
         
-        r.stdout_text = ubuf_to_string(&b);
+        cr_set_buf(&r, &b);
     }
     return r;
 }
@@ -995,11 +1343,6 @@ static CommandResult cmd_history_next(TokenArray *t) {
 static CommandResult cmd_complete(TokenArray *t) {
     CommandResult r;
     cr_init(&r);
-    if (t->count < 2) {
-        r.status = 1;
-        cr_set_err(&r, "complete: need prefix");
-        return r;
-    }
     {
         char **words;
         int count;
@@ -1012,47 +1355,26 @@ static CommandResult cmd_complete(TokenArray *t) {
     return r;
 }
 
-CommandResult cmd_execute(TokenArray *tokens) {
+static CommandResult run_command(TokenArray *tokens) {
     CommandResult r;
     cr_init(&r);
     if (tokens->count == 0) {
         cr_set_out(&r, "");
         return r;
     }
-    if (u_strcmp(tokens->items[0], "mkdir") == 0) return cmd_mkdir(tokens);
-    if (u_strcmp(tokens->items[0], "ls") == 0) return cmd_ls(tokens);
-    if (u_strcmp(tokens->items[0], "cd") == 0) return cmd_cd(tokens);
-    if (u_strcmp(tokens->items[0], "touch") == 0) return cmd_touch(tokens);
-    if (u_strcmp(tokens->items[0], "write") == 0) return cmd_write(tokens);
-    if (u_strcmp(tokens->items[0], "read") == 0) return cmd_read(tokens);
-    if (u_strcmp(tokens->items[0], "rm") == 0) return cmd_rm(tokens);
-    if (u_strcmp(tokens->items[0], "rmdir") == 0) return cmd_rmdir(tokens);
-    if (u_strcmp(tokens->items[0], "pwd") == 0) return cmd_pwd(tokens);
-    if (u_strcmp(tokens->items[0], "cat") == 0) return cmd_cat(tokens);
-
-    if (u_strcmp(tokens->items[0], "set") == 0) return cmd_set(tokens);
-    if (u_strcmp(tokens->items[0], "get") == 0) return cmd_get(tokens);
-    if (u_strcmp(tokens->items[0], "unset") == 0) return cmd_unset(tokens);
-    if (u_strcmp(tokens->items[0], "listenv") == 0) return cmd_listenv(tokens);
-
-    if (u_strcmp(tokens->items[0], "history") == 0) return cmd_history(tokens);
-    if (u_strcmp(tokens->items[0], "undo") == 0) return cmd_undo(tokens);
-    if (u_strcmp(tokens->items[0], "redo") == 0) return cmd_redo(tokens);
-
-    if (u_strcmp(tokens->items[0], "search") == 0) return cmd_search(tokens);
-    if (u_strcmp(tokens->items[0], "help") == 0) return cmd_help(tokens);
-    if (u_strcmp(tokens->items[0], "log") == 0) return cmd_log(tokens);
-    if (u_strcmp(tokens->items[0], "chmod") == 0) return cmd_chmod(tokens);
-    if (u_strcmp(tokens->items[0], "export") == 0) return cmd_export(tokens);
-    if (u_strcmp(tokens->items[0], "import") == 0) return cmd_import(tokens);
-    if (u_strcmp(tokens->items[0], "cp") == 0) return cmd_cp(tokens);
-    if (u_strcmp(tokens->items[0], "mv") == 0) return cmd_mv(tokens);
-    if (u_strcmp(tokens->items[0], "tree") == 0) return cmd_tree(tokens);
-    if (u_strcmp(tokens->items[0], "complete") == 0) return cmd_complete(tokens);
-    if (u_strcmp(tokens->items[0], "rename") == 0) return cmd_rename(tokens);
-    if (u_strcmp(tokens->items[0], "stat") == 0) return cmd_stat(tokens);
-    if (u_strcmp(tokens->items[0], "history_prev") == 0) return cmd_history_prev(tokens);
-    if (u_strcmp(tokens->items[0], "history_next") == 0) return cmd_history_next(tokens);
+    {
+        const CommandSpec *spec = commands_lookup(tokens->items[0]);
+        if (spec) {
+            int need = spec->min_args;
+            if (pipe_has_in && (spec->flags & CMD_STDIN)) need--;
+            if (tokens->count - 1 < need) {
+                r.status = 1;
+                cr_set_err(&r, spec->usage_error);
+                return r;
+            }
+            return spec->handler(tokens);
+        }
+    }
 
     /* Unknown command - suggest closest using Levenshtein distance */
     {
@@ -1061,15 +1383,15 @@ CommandResult cmd_execute(TokenArray *tokens) {
         const char *best_match = 0;
         UBuffer err;
         
-        for (i = 0; i < all_commands_count; i++) {
-            int dist = u_levenshtein(tokens->items[0], all_commands[i]);
+        for (i = 0; i < registry_count; i++) {
+            int dist = u_levenshtein(tokens->items[0], registry[i].name);
             if (dist < min_dist) {
                 min_dist = dist;
-                best_match = all_commands[i];
+                best_match = registry[i].name;
             }
         }
         
-        ubuf_init(&err);
+        ubuf_init_temp(&err);
         ubuf_append_str(&err, "Unknown command: ");
         ubuf_append_str(&err, tokens->items[0]);
         
@@ -1080,8 +1402,121 @@ CommandResult cmd_execute(TokenArray *tokens) {
         }
         
         r.status = 1;
-        r.stderr_text = ubuf_to_string(&err);
+        r.stderr_text = err.data;
+    }
+    return r;
+}
+
+/* Tokens [start, end) of t as a command of their own */
+static void stage_view(TokenArray *t, int start, int end, TokenArray *out) {
+    parser_init(out);
+    out->items = t->items + start;
+    out->lens = t->lens + start;
+    out->kinds = t->kinds + start;
+    out->count = end - start;
+}
+
+static CommandResult syntax_error(const char *op) {
+    CommandResult r;
+    UBuffer err;
+    cr_init(&r);
+    ubuf_init_temp(&err);
+    ubuf_append_str(&err, "syntax error near '");
+    ubuf_append_str(&err, op);
+    ubuf_append_char(&err, '\'');
+    r.status = 1;
+    r.stderr_text = err.data;
+    return r;
+}
+
+/*
+ * Stages joined by `|` run one after another in this process. A stage's
+ * stdout is collected in the request arena and read in place by the next
+ * stage as its piped input; only the last stage may stream to the sink.
+ * With `> file` / `>> file` the last stage's output goes straight into
+ * the file's content buffer through fs_write_mem. The target is only
+ * checked up front; it is truncated and written once every stage has
+ * succeeded, as a stage may still be reading that same file and a failed
+ * one must leave it as it was.
+ */
+static CommandResult run_pipeline(TokenArray *tokens, int end, int redirect) {
+    CmdOutputSink sink = out_sink;
+    CommandResult r;
+    const char *target = 0;
+    Content old;
+    int start = 0;
+    int i;
+
+    if (redirect) {
+        target = tokens->items[end + 1];
+        /* a bad path fails before anything runs */
+        if (fs_check_write(target) != 0) {
+            cr_init(&r);
+            r.status = 1;
+            cr_set_err(&r, "redirect: cannot write file");
+            return r;
+        }
+    }
+    for (i = 0; i <= end; i++) {
+        TokenArray stage;
+        if (i < end && tokens->kinds[i] != TOK_PIPE) continue;
+        stage_view(tokens, start, i, &stage);
+        out_sink = (i == end && !redirect) ? sink : 0;
+        r = run_command(&stage);
+        out_sink = sink;
+        if (r.status != 0 || i == end) break;
+        pipe_has_in = 1;
+        pipe_in = r.stdout_text ? r.stdout_text : "";
+        pipe_in_len = r.stdout_len >= 0 ? r.stdout_len : u_strlen(pipe_in);
+        start = i + 1;
+    }
+    pipe_has_in = 0;
+    pipe_in = 0;
+    pipe_in_len = 0;
+    if (!redirect || r.status != 0) return r;
+
+    {
+        const char *text = r.stdout_text ? r.stdout_text : "";
+        int len = r.stdout_len >= 0 ? r.stdout_len : u_strlen(text);
+        content_init(&old);
+        fs_snapshot(target, &old);
+        if (fs_write_mem(target, text, len, tokens->kinds[end] == TOK_APPEND) != 0) {
+            content_free(&old);
+            r.status = 1;
+            cr_set_err(&r, "redirect: cannot write file");
+            return r;
+        }
+        push_write_op(target, &old);
     }
+    cr_set_out(&r, "");
     return r;
 }
 
+CommandResult cmd_execute(TokenArray *tokens) {
+    int end = tokens->count;
+    int piped = 0;
+    int i;
+    for (i = 0; i < tokens->count; i++) {
+        int kind = tokens->kinds[i];
+        if (kind == TOK_WORD) continue;
+        /* an operator needs a command before it */
+        if (i == 0 || tokens->kinds[i - 1] != TOK_WORD) return syntax_error(tokens->items[i]);
+        if (kind == TOK_PIPE) {
+            piped = 1;
+            continue;
+        }
+        /* a redirect ends the line: exactly one file name follows */
+        if (i + 2 != tokens->count || tokens->kinds[i + 1] != TOK_WORD) {
+            return syntax_error(tokens->items[i]);
+        }
+        end = i;
+        break;
+    }
+    if (end < tokens->count) return run_pipeline(tokens, end, 1);
+    if (piped) {
+        if (tokens->kinds[end - 1] != TOK_WORD) return syntax_error("|");
+        return run_pipeline(tokens, end, 0);
+    }
+    return run_command(tokens);
+}
+
@@ -10,13 +10,56 @@
 typedef struct {
     int status;         /* 0 ok, nonzero error */
     char *stdout_text;  /* main output */
+    int stdout_len;     /* length of stdout_text, or -1 if not known */
     char *stderr_text;  /* error message, may be empty */
     char **suggestions; /* for autocomplete */
     int suggestion_count;
+    int streamed;       /* stdout already went to the output sink */
 } CommandResult;
 
+/* Receives large command output in bounded chunks as it is produced */
+typedef void (*CmdOutputSink)(const char *data, int len, void *user);
+
+typedef CommandResult (*CommandHandler)(TokenArray *t);
+
+#define CMD_READONLY 0
+#define CMD_MUTATES 1  /* changes the filesystem or variables */
+#define CMD_STDIN 2    /* reads piped input in place of its last required
+                          argument (`... | cat`, `... | write f`) */
+
+/* One registered command; the registry is generated from commands.def */
+typedef struct {
+    const char *name;
+    CommandHandler handler;
+    int min_args;            /* arguments required after the name */
+    int flags;               /* CMD_READONLY or CMD_MUTATES, | CMD_STDIN */
+    const char *usage_error; /* reply when min_args is not met */
+    const char *help;        /* one line for `help` */
+} CommandSpec;
+
+/* Per-session command state: undo/redo stacks, variables and logs */
+typedef struct {
+    OpStack undo_stack;
+    OpStack redo_stack;
+    HashMap vars;
+    LogQueue logger_q;
+} CommandState;
+
+void commands_state_init(CommandState *st);
+void commands_state_free(CommandState *st);
+void commands_bind(CommandState *st);
+/* Variables of the bound session, for $NAME expansion */
+HashMap *commands_vars();
+
+/* Builds the shared command trie; call once per process */
 void commands_init();
+/* Install (or clear, with 0) the sink used by the next cmd_execute */
+void commands_set_sink(CmdOutputSink sink, void *user);
+/* Run a command line: one command, or a pipeline `a | b | c` with an
+   optional final `> file` or `>> file` */
 CommandResult cmd_execute(TokenArray *tokens);
+/* Registry entry for a command name, or 0 if there is no such command */
+const CommandSpec *commands_lookup(const char *name);
 
 #endif
 
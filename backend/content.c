@@ -0,0 +1,211 @@
+#include "content.h"
+#include "utils.h"
+
+#define CONTENT_MIN 16
+
+typedef struct ContentChunk {
+    int cap;
+    int refs;      /* Contents holding this chunk; read-only while > 1 */
+    char data[1];
+} ContentChunk;
+
+static ContentChunk *chunk_new(int cap) {
+    ContentChunk *k = (ContentChunk *)u_malloc(sizeof(ContentChunk) + cap - 1);
+    k->cap = cap;
+    k->refs = 1;
+    return k;
+}
+
+static void chunk_release(ContentChunk *k) {
+    if (--k->refs == 0) u_free(k);
+}
+
+/* Bytes used in chunk i */
+static int chunk_len(const Content *c, int i) {
+    return i < c->count - 1 ? CONTENT_CHUNK : c->size - (c->count - 1) * CONTENT_CHUNK;
+}
+
+/* Make chunk i private to c before writing to it */
+static ContentChunk *chunk_own(Content *c, int i) {
+    ContentChunk *k = c->chunks[i];
+    if (k->refs > 1) {
+        ContentChunk *nk = chunk_new(k->cap);
+        u_memcpy(nk->data, k->data, chunk_len(c, i));
+        chunk_release(k);
+        c->chunks[i] = nk;
+        k = nk;
+    }
+    return k;
+}
+
+/* Capacity for a last chunk that must hold `need` bytes */
+static int chunk_cap_for(int need) {
+    int cap = CONTENT_MIN;
+    while (cap < need && cap < CONTENT_CHUNK) cap *= 2;
+    return cap;
+}
+
+void content_init(Content *c) {
+    c->chunks = 0;
+    c->count = 0;
+    c->capacity = 0;
+    c->size = 0;
+}
+
+void content_free(Content *c) {
+    int i;
+    for (i = 0; i < c->count; i++) chunk_release(c->chunks[i]);
+    if (c->chunks) u_free(c->chunks);
+    content_init(c);
+}
+
+void content_share(Content *dst, const Content *src) {
+    int i;
+    if (dst == src) return;
+    content_free(dst);
+    if (src->count == 0) return;
+    dst->chunks = (ContentChunk **)u_malloc(sizeof(ContentChunk *) * src->count);
+    for (i = 0; i < src->count; i++) {
+        dst->chunks[i] = src->chunks[i];
+        dst->chunks[i]->refs++;
+    }
+    dst->count = src->count;
+    dst->capacity = src->count;
+    dst->size = src->size;
+}
+
+static void content_push(Content *c, ContentChunk *k) {
+    if (c->count == c->capacity) {
+        int newcap = c->capacity ? c->capacity * 2 : 4;
+        ContentChunk **nc = (ContentChunk **)u_malloc(sizeof(ContentChunk *) * newcap);
+        u_memcpy(nc, c->chunks, sizeof(ContentChunk *) * c->count);
+        if (c->chunks) u_free(c->chunks);
+        c->chunks = nc;
+        c->capacity = newcap;
+    }
+    c->chunks[c->count++] = k;
+}
+
+void content_append(Content *c, const char *data, int len) {
+    while (len > 0) {
+        ContentChunk *last = c->count ? c->chunks[c->count - 1] : 0;
+        int used = c->count ? chunk_len(c, c->count - 1) : 0;
+        int n;
+        if (!last || used == CONTENT_CHUNK) {
+            last = chunk_new(chunk_cap_for(len));
+            content_push(c, last);
+            used = 0;
+        } else if (used == last->cap || used + len > last->cap) {
+            /* a short last chunk grows (by copying at most one chunk)
+               before another is started */
+            if (last->cap < CONTENT_CHUNK) {
+                ContentChunk *k = chunk_new(chunk_cap_for(used + len));
+                u_memcpy(k->data, last->data, used);
+                chunk_release(last);
+                c->chunks[c->count - 1] = k;
+                last = k;
+            }
+        }
+        if (last->refs > 1) last = chunk_own(c, c->count - 1);
+        n = last->cap - used;
+        if (n > len) n = len;
+        u_memcpy(last->data + used, data, n);
+        c->size += n;
+        data += n;
+        len -= n;
+    }
+}
+
+void content_set(Content *c, const char *data, int len) {
+    content_free(c);
+    content_append(c, data, len);
+}
+
+int content_chunk(const Content *c, int i, const char **data) {
+    *data = c->chunks[i]->data;
+    return chunk_len(c, i);
+}
+
+void content_read(const Content *c, int off, int len, char *dst) {
+    int i = off / CONTENT_CHUNK;
+    int at = off % CONTENT_CHUNK;
+    while (len > 0) {
+        int n = chunk_len(c, i) - at;
+        if (n > len) n = len;
+        u_memcpy(dst, c->chunks[i]->data + at, n);
+        dst += n;
+        len -= n;
+        i++;
+        at = 0;
+    }
+}
+
+void content_write_at(Content *c, int off, const char *data, int len) {
+    int i = off / CONTENT_CHUNK;
+    int at = off % CONTENT_CHUNK;
+    while (len > 0 && off < c->size) {
+        int n = chunk_len(c, i) - at;
+        if (n > len) n = len;
+        u_memcpy(chunk_own(c, i)->data + at, data, n);
+        data += n;
+        len -= n;
+        off += n;
+        i++;
+        at = 0;
+    }
+    content_append(c, data, len);
+}
+
+void content_insert(Content *c, int off, const char *data, int len) {
+    int rest = c->size - off;
+    char *tail = (char *)u_malloc(rest > 0 ? rest : 1);
+    content_read(c, off, rest, tail);
+    content_truncate(c, off);
+    content_append(c, data, len);
+    content_append(c, tail, rest);
+    u_free(tail);
+}
+
+void content_truncate(Content *c, int size) {
+    int keep = size > 0 ? (size - 1) / CONTENT_CHUNK + 1 : 0;
+    int i;
+    for (i = keep; i < c->count; i++) chunk_release(c->chunks[i]);
+    c->count = keep;
+    c->size = size;
+}
+
+int content_line_start(const Content *c, int line) {
+    int seen = 0;
+    int k;
+    if (line <= 1) return 0;
+    for (k = 0; k < c->count; k++) {
+        const char *d = c->chunks[k]->data;
+        int n = chunk_len(c, k);
+        int i;
+        for (i = 0; i < n; i++) {
+            if (d[i] == '\n' && ++seen == line - 1) return k * CONTENT_CHUNK + i + 1;
+        }
+    }
+    return -1;
+}
+
+int content_tail_start(const Content *c, int n) {
+    int end = c->size;
+    int seen = 0;
+    int k;
+    if (n <= 0) return c->size;
+    if (end > 0) {
+        const char *last;
+        int len = content_chunk(c, c->count - 1, &last);
+        if (last[len - 1] == '\n') end--;
+    }
+    for (k = (end - 1) / CONTENT_CHUNK; k >= 0 && end > 0; k--) {
+        const char *d = c->chunks[k]->data;
+        int i;
+        for (i = end - 1 - k * CONTENT_CHUNK; i >= 0; i--) {
+            if (d[i] == '\n' && ++seen == n) return k * CONTENT_CHUNK + i + 1;
+        }
+        end = k * CONTENT_CHUNK;
+    }
+    return 0;
+}
@@ -0,0 +1,56 @@
+#ifndef CONTENT_H
+#define CONTENT_H
+
+/*
+ * File content as a list of fixed-size chunks. Every chunk but the last
+ * is exactly CONTENT_CHUNK bytes, so byte offset o lives in chunk
+ * o / CONTENT_CHUNK. Appending fills the last chunk and then starts a new
+ * one; nothing already written is ever moved. Only the last chunk may be
+ * smaller: a small file is a single chunk sized to fit, which doubles
+ * until it reaches CONTENT_CHUNK.
+ *
+ * Chunks are reference counted, so copying a Content with content_share
+ * costs one pointer per chunk rather than its bytes. A chunk held by more
+ * than one Content is never written: the writer clones it first, so only
+ * the chunks actually touched are ever duplicated.
+ */
+
+#define CONTENT_CHUNK 65536
+
+struct ContentChunk;
+
+typedef struct {
+    struct ContentChunk **chunks;
+    int count;     /* chunks in use */
+    int capacity;  /* slots in chunks */
+    int size;      /* bytes */
+} Content;
+
+void content_init(Content *c);
+void content_free(Content *c);
+/* Make dst (freed first) a copy of src that shares its chunks */
+void content_share(Content *dst, const Content *src);
+/* Replace everything with len bytes of data */
+void content_set(Content *c, const char *data, int len);
+void content_append(Content *c, const char *data, int len);
+/* Chunk i (0 <= i < count): points *data at its bytes, returns its length.
+   Walking i = 0 .. count-1 visits the content in order. */
+int content_chunk(const Content *c, int i, const char **data);
+/* Copy len bytes starting at off into dst (the range must be in bounds) */
+void content_read(const Content *c, int off, int len, char *dst);
+
+/* Overwrite from off (at most size), growing past the end if needed */
+void content_write_at(Content *c, int off, const char *data, int len);
+/* Insert at off (at most size); moves the bytes after it */
+void content_insert(Content *c, int off, const char *data, int len);
+/* Cut to size bytes (at most the current size) */
+void content_truncate(Content *c, int size);
+
+/* Offset where 1-based line `line` starts: line 1 at 0, line k after the
+   (k-1)th newline. -1 if there are fewer newlines than that. */
+int content_line_start(const Content *c, int line);
+/* Offset where the last n lines start, scanning back from the end; a
+   final newline ends the last line rather than starting another */
+int content_tail_start(const Content *c, int n);
+
+#endif
@@ -0,0 +1,346 @@
+#include "dirtree.h"
+#include "filesystem.h"
+#include "utils.h"
+
+#define DT_MAX 32          /* entries per node */
+#define DT_MIN (DT_MAX / 2)
+#define DT_SMALL 4         /* first capacity of a lone root leaf */
+
+typedef struct DtNode {
+    int leaf;
+    int count;
+} DtNode;
+
+typedef struct DtLeaf {
+    DtNode h;
+    int cap;
+    struct DtLeaf *next;   /* right sibling, for in-order walks */
+    TreeNode *key[1];      /* cap entries, sorted by name */
+} DtLeaf;
+
+typedef struct {
+    DtNode h;
+    TreeNode *low[DT_MAX]; /* smallest name under child[i] */
+    DtNode *child[DT_MAX];
+} DtInner;
+
+static DtLeaf *leaf_new(int cap) {
+    DtLeaf *l = (DtLeaf *)u_malloc(sizeof(DtLeaf) + sizeof(TreeNode *) * (cap - 1));
+    l->h.leaf = 1;
+    l->h.count = 0;
+    l->cap = cap;
+    l->next = 0;
+    return l;
+}
+
+static DtInner *inner_new() {
+    DtInner *n = (DtInner *)u_malloc(sizeof(DtInner));
+    n->h.leaf = 0;
+    n->h.count = 0;
+    return n;
+}
+
+/* Names are interned, so equal names are usually the same pointer */
+static int name_cmp(const char *a, const char *b) {
+    return a == b ? 0 : u_strcmp(a, b);
+}
+
+static TreeNode *node_low(const DtNode *n) {
+    if (n->leaf) return n->count ? ((const DtLeaf *)n)->key[0] : 0;
+    return ((const DtInner *)n)->low[0];
+}
+
+/* First position in l whose name is >= name */
+static int leaf_lower(const DtLeaf *l, const char *name) {
+    int lo = 0;
+    int hi = l->h.count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (name_cmp(fs_node_name(l->key[mid]), name) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/* The child of n whose range holds name */
+static int inner_slot(const DtInner *n, const char *name) {
+    int lo = 1;
+    int hi = n->h.count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (name_cmp(fs_node_name(n->low[mid]), name) <= 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo - 1;
+}
+
+static void leaf_insert_at(DtLeaf *l, int pos, TreeNode *node) {
+    int i;
+    for (i = l->h.count; i > pos; i--) l->key[i] = l->key[i - 1];
+    l->key[pos] = node;
+    l->h.count++;
+}
+
+static void inner_insert_at(DtInner *n, int pos, DtNode *child) {
+    int i;
+    for (i = n->h.count; i > pos; i--) {
+        n->low[i] = n->low[i - 1];
+        n->child[i] = n->child[i - 1];
+    }
+    n->low[pos] = node_low(child);
+    n->child[pos] = child;
+    n->h.count++;
+}
+
+static void inner_remove_at(DtInner *n, int pos) {
+    int i;
+    for (i = pos; i < n->h.count - 1; i++) {
+        n->low[i] = n->low[i + 1];
+        n->child[i] = n->child[i + 1];
+    }
+    n->h.count--;
+}
+
+void dt_init(DirTree *t) {
+    t->root = 0;
+}
+
+static void dt_free_rec(DtNode *n) {
+    int i;
+    if (!n->leaf) {
+        DtInner *in = (DtInner *)n;
+        for (i = 0; i < in->h.count; i++) dt_free_rec(in->child[i]);
+    }
+    u_free(n);
+}
+
+void dt_free(DirTree *t) {
+    if (t->root) dt_free_rec(t->root);
+    t->root = 0;
+}
+
+TreeNode *dt_find(const DirTree *t, const char *name) {
+    const DtNode *n = t->root;
+    const DtLeaf *l;
+    int pos;
+    if (!n) return 0;
+    while (!n->leaf) {
+        const DtInner *in = (const DtInner *)n;
+        n = in->child[inner_slot(in, name)];
+    }
+    l = (const DtLeaf *)n;
+    pos = leaf_lower(l, name);
+    if (pos < l->h.count && name_cmp(fs_node_name(l->key[pos]), name) == 0) return l->key[pos];
+    return 0;
+}
+
+/* Insert into the subtree at n; returns the new right half if n split */
+static DtNode *insert_rec(DtNode *n, TreeNode *node, int *dup) {
+    int half = DT_MAX / 2;
+    int i;
+    if (n->leaf) {
+        DtLeaf *l = (DtLeaf *)n;
+        DtLeaf *r;
+        int pos = leaf_lower(l, fs_node_name(node));
+        if (pos < l->h.count && name_cmp(fs_node_name(l->key[pos]), fs_node_name(node)) == 0) {
+            *dup = 1;
+            return 0;
+        }
+        if (l->h.count < l->cap) {
+            leaf_insert_at(l, pos, node);
+            return 0;
+        }
+        r = leaf_new(DT_MAX);
+        for (i = half; i < DT_MAX; i++) r->key[i - half] = l->key[i];
+        r->h.count = DT_MAX - half;
+        l->h.count = half;
+        r->next = l->next;
+        l->next = r;
+        if (pos <= half) {
+            leaf_insert_at(l, pos, node);
+        } else {
+            leaf_insert_at(r, pos - half, node);
+        }
+        return (DtNode *)r;
+    } else {
+        DtInner *in = (DtInner *)n;
+        DtInner *r;
+        int ci = inner_slot(in, fs_node_name(node));
+        DtNode *split = insert_rec(in->child[ci], node, dup);
+        in->low[ci] = node_low(in->child[ci]);
+        if (!split) return 0;
+        if (in->h.count < DT_MAX) {
+            inner_insert_at(in, ci + 1, split);
+            return 0;
+        }
+        r = inner_new();
+        for (i = half; i < DT_MAX; i++) {
+            r->low[i - half] = in->low[i];
+            r->child[i - half] = in->child[i];
+        }
+        r->h.count = DT_MAX - half;
+        in->h.count = half;
+        if (ci + 1 <= half) {
+            inner_insert_at(in, ci + 1, split);
+        } else {
+            inner_insert_at(r, ci + 1 - half, split);
+        }
+        return (DtNode *)r;
+    }
+}
+
+int dt_insert(DirTree *t, TreeNode *node) {
+    DtNode *split;
+    int dup = 0;
+    if (!t->root) t->root = (DtNode *)leaf_new(DT_SMALL);
+    if (t->root->leaf) {
+        /* a lone leaf grows in place before it ever splits */
+        DtLeaf *l = (DtLeaf *)t->root;
+        if (l->h.count == l->cap && l->cap < DT_MAX) {
+            int cap = l->cap * 2 < DT_MAX ? l->cap * 2 : DT_MAX;
+            DtLeaf *nl = leaf_new(cap);
+            u_memcpy(nl->key, l->key, sizeof(TreeNode *) * l->h.count);
+            nl->h.count = l->h.count;
+            u_free(l);
+            t->root = (DtNode *)nl;
+        }
+    }
+    split = insert_rec(t->root, node, &dup);
+    if (dup) return -1;
+    if (split) {
+        DtInner *r = inner_new();
+        inner_insert_at(r, 0, t->root);
+        inner_insert_at(r, 1, split);
+        t->root = (DtNode *)r;
+    }
+    return 0;
+}
+
+/* Move one entry from the end of left to the front of c */
+static void take_from_left(DtNode *left, DtNode *c) {
+    if (c->leaf) {
+        DtLeaf *l = (DtLeaf *)left;
+        leaf_insert_at((DtLeaf *)c, 0, l->key[--l->h.count]);
+    } else {
+        DtInner *l = (DtInner *)left;
+        inner_insert_at((DtInner *)c, 0, l->child[--l->h.count]);
+    }
+}
+
+/* Move one entry from the front of right to the end of c */
+static void take_from_right(DtNode *c, DtNode *right) {
+    int i;
+    if (c->leaf) {
+        DtLeaf *r = (DtLeaf *)right;
+        DtLeaf *l = (DtLeaf *)c;
+        l->key[l->h.count++] = r->key[0];
+        for (i = 0; i < r->h.count - 1; i++) r->key[i] = r->key[i + 1];
+        r->h.count--;
+    } else {
+        DtInner *r = (DtInner *)right;
+        DtInner *l = (DtInner *)c;
+        inner_insert_at(l, l->h.count, r->child[0]);
+        inner_remove_at(r, 0);
+    }
+}
+
+/* Append all of b to a (its left neighbour) and free b */
+static void merge(DtNode *a, DtNode *b) {
+    int i;
+    if (a->leaf) {
+        DtLeaf *l = (DtLeaf *)a;
+        DtLeaf *r = (DtLeaf *)b;
+        for (i = 0; i < r->h.count; i++) l->key[l->h.count++] = r->key[i];
+        l->next = r->next;
+    } else {
+        DtInner *l = (DtInner *)a;
+        DtInner *r = (DtInner *)b;
+        for (i = 0; i < r->h.count; i++) {
+            l->low[l->h.count] = r->low[i];
+            l->child[l->h.count++] = r->child[i];
+        }
+    }
+    u_free(b);
+}
+
+/* child[ci] of p dropped below DT_MIN: borrow from a sibling or merge */
+static void rebalance(DtInner *p, int ci) {
+    DtNode *c = p->child[ci];
+    DtNode *left = ci > 0 ? p->child[ci - 1] : 0;
+    DtNode *right = ci + 1 < p->h.count ? p->child[ci + 1] : 0;
+    if (left && left->count > DT_MIN) {
+        take_from_left(left, c);
+        p->low[ci] = node_low(c);
+    } else if (right && right->count > DT_MIN) {
+        take_from_right(c, right);
+        p->low[ci] = node_low(c);
+        p->low[ci + 1] = node_low(right);
+    } else if (left) {
+        merge(left, c);
+        inner_remove_at(p, ci);
+    } else if (right) {
+        merge(c, right);
+        inner_remove_at(p, ci + 1);
+        p->low[ci] = node_low(c);
+    } else {
+        p->low[ci] = node_low(c);
+    }
+}
+
+static int remove_rec(DtNode *n, TreeNode *node) {
+    int i;
+    if (n->leaf) {
+        DtLeaf *l = (DtLeaf *)n;
+        int pos = leaf_lower(l, fs_node_name(node));
+        if (pos >= l->h.count || l->key[pos] != node) return -1;
+        for (i = pos; i < l->h.count - 1; i++) l->key[i] = l->key[i + 1];
+        l->h.count--;
+        return 0;
+    } else {
+        DtInner *in = (DtInner *)n;
+        int ci = inner_slot(in, fs_node_name(node));
+        if (remove_rec(in->child[ci], node) != 0) return -1;
+        if (in->child[ci]->count < DT_MIN) {
+            rebalance(in, ci);
+        } else {
+            in->low[ci] = node_low(in->child[ci]);
+        }
+        return 0;
+    }
+}
+
+int dt_remove(DirTree *t, TreeNode *node) {
+    if (!t->root || remove_rec(t->root, node) != 0) return -1;
+    if (!t->root->leaf && t->root->count == 1) {
+        DtNode *only = ((DtInner *)t->root)->child[0];
+        u_free(t->root);
+        t->root = only;
+    }
+    if (t->root->leaf && t->root->count == 0) {
+        u_free(t->root);
+        t->root = 0;
+    }
+    return 0;
+}
+
+void dt_iter_init(const DirTree *t, DirIter *it) {
+    const DtNode *n = t->root;
+    while (n && !n->leaf) n = ((const DtInner *)n)->child[0];
+    it->leaf = (DtLeaf *)n;
+    it->pos = 0;
+}
+
+TreeNode *dt_iter_next(DirIter *it) {
+    while (it->leaf && it->pos >= it->leaf->h.count) {
+        it->leaf = it->leaf->next;
+        it->pos = 0;
+    }
+    if (!it->leaf) return 0;
+    return it->leaf->key[it->pos++];
+}
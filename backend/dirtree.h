@@ -0,0 +1,39 @@
+#ifndef DIRTREE_H
+#define DIRTREE_H
+
+/*
+ * Ordered children of a directory: a B+tree of TreeNode pointers keyed
+ * by name. Lookup, insert and delete are O(log n); the leaves are linked,
+ * so walking them gives the children in name order. An empty tree
+ * allocates nothing, and a small directory is a single leaf that grows
+ * in place until it is full.
+ */
+
+struct TreeNode;
+struct DtNode;
+struct DtLeaf;
+
+typedef struct {
+    struct DtNode *root;
+} DirTree;
+
+typedef struct {
+    struct DtLeaf *leaf;
+    int pos;
+} DirIter;
+
+void dt_init(DirTree *t);
+/* Release the tree itself; the TreeNodes it holds are left alone */
+void dt_free(DirTree *t);
+struct TreeNode *dt_find(const DirTree *t, const char *name);
+/* Returns -1 (and leaves t unchanged) if the name is already present */
+int dt_insert(DirTree *t, struct TreeNode *node);
+/* Remove node, found by its current name; returns -1 if absent */
+int dt_remove(DirTree *t, struct TreeNode *node);
+
+/* In name order: dt_iter_init, then dt_iter_next until it returns 0.
+   The tree must not change during the walk. */
+void dt_iter_init(const DirTree *t, DirIter *it);
+struct TreeNode *dt_iter_next(DirIter *it);
+
+#endif
@@ -1,109 +1,270 @@
 #include <stdio.h>
+#include <stdint.h>
 #include <time.h>
 #include "filesystem.h"
 #include "utils.h"
+#include "arena.h"
+#include "nametable.h"
 
 unsigned long long fs_get_time() {
     return (unsigned long long)time(0);
 }
 
-static TreeNode *fs_root = 0;
-static TreeNode *fs_cwd = 0;
+static FsState fs_default = { 0, 0 };
+static FsState *cur_fs = &fs_default;
+/* shared by every session, so a version identifies one node's content */
+static unsigned long long fs_next_version = 1;
+
+/*
+ * Path lookups are remembered in a direct-mapped cache keyed by (start
+ * node, path). A hit is trusted only while the generation it was filled
+ * under is current: fs_gen_unlink moves whenever a path may stop naming
+ * the node it named (rm, rmdir, rename, mv, clear), fs_gen_link whenever
+ * a path that named nothing may start to (a new child, a rename or a
+ * move). Positive entries check the first, negative ones the second.
+ * Both are shared by all sessions; a node is only freed after a bump, so
+ * a stale start pointer never matches a live entry.
+ */
+#define FS_DCACHE_SIZE 1024
+
+typedef struct {
+    unsigned int hash;
+    int len;
+    int cap;                  /* bytes allocated for path, reused on refill */
+    const TreeNode *start;
+    char *path;
+    TreeNode *node;           /* 0 for "no such path" */
+    unsigned long gen;
+} FsDentry;
+
+static FsDentry fs_dcache[FS_DCACHE_SIZE];
+static unsigned long fs_gen_unlink = 1;
+static unsigned long fs_gen_link = 1;
+
+/* Directories with more children than this get a hash index */
+#define FS_INDEX_MIN 16
+
+/* Open addressing with linear probing; node 0 marks an empty slot */
+typedef struct FsIndexSlot {
+    unsigned int hash;
+    TreeNode *node;
+} FsIndexSlot;
+
+/*
+ * Nodes are carved from slabs of FS_SLAB_NODES and never handed back to
+ * malloc: fs_free_node puts them on a free list, linked through
+ * `parent`, that fs_create_node takes from first.
+ */
+#define FS_SLAB_NODES 1024
+
+static TreeNode *fs_slab = 0;
+static int fs_slab_used = FS_SLAB_NODES;
+static TreeNode *fs_free_nodes = 0;
+
+static TreeNode *fs_node_alloc() {
+    TreeNode *n = fs_free_nodes;
+    if (n) {
+        fs_free_nodes = n->parent;
+        return n;
+    }
+    if (fs_slab_used == FS_SLAB_NODES) {
+        fs_slab = (TreeNode *)u_malloc(sizeof(TreeNode) * FS_SLAB_NODES);
+        fs_slab_used = 0;
+    }
+    return &fs_slab[fs_slab_used++];
+}
+
+const char *fs_node_name(const TreeNode *n) {
+    return n->name->str;
+}
+
+static void fs_set_name(TreeNode *n, const char *name) {
+    Name *nm = name_intern(name);
+    if (n->name) name_release(n->name);
+    n->name = nm;
+}
 
 static TreeNode *fs_create_node(const char *name, NodeType type) {
-    TreeNode *n = (TreeNode *)u_malloc(sizeof(TreeNode));
-    unsigned long long now = fs_get_time();
-    n->name = u_strdup(name);
+    TreeNode *n = fs_node_alloc();
+    unsigned int now = (unsigned int)fs_get_time();
+    n->name = 0;
+    fs_set_name(n, name);
     n->type = type;
-    n->content = 0;
-    n->content_size = 0;
-    n->content_capacity = 0;
+    if (type == NODE_DIR) {
+        dt_init(&n->u.dir.children);
+        n->u.dir.index = 0;
+        n->u.dir.count = 0;
+        n->u.dir.index_capacity = 0;
+    } else {
+        content_init(&n->u.file);
+    }
     n->perms_read = 1;
     n->perms_write = 1;
-    n->children = 0;
-    n->child_count = 0;
-    n->child_capacity = 0;
     n->parent = 0;
     n->created_at = now;
     n->modified_at = now;
+    n->version = fs_next_version++;
     return n;
 }
 
+void fs_bind(FsState *st) {
+    cur_fs = st ? st : &fs_default;
+}
+
 void fs_init() {
-    fs_root = fs_create_node("/", NODE_DIR);
-    fs_root->parent = 0;
-    fs_cwd = fs_root;
+    cur_fs->root = fs_create_node("/", NODE_DIR);
+    cur_fs->root->parent = 0;
+    cur_fs->cwd = cur_fs->root;
 }
 
 TreeNode *fs_get_root() {
-    return fs_root;
+    return cur_fs->root;
 }
 
 TreeNode *fs_get_cwd() {
-    return fs_cwd;
+    return cur_fs->cwd;
 }
 
 void fs_set_cwd(TreeNode *n) {
     if (n && n->type == NODE_DIR) {
-        fs_cwd = n;
+        cur_fs->cwd = n;
     }
 }
 
-static void fs_add_child(TreeNode *dir, TreeNode *child) {
+static void fs_index_put(FsIndexSlot *slots, int capacity, unsigned int hash, TreeNode *node) {
+    int mask = capacity - 1;
+    int i = (int)(hash & (unsigned int)mask);
+    while (slots[i].node) i = (i + 1) & mask;
+    slots[i].hash = hash;
+    slots[i].node = node;
+}
+
+/* (Re)build the index of dir with room for `capacity` slots (a power of two) */
+static void fs_index_rebuild(TreeNode *dir, int capacity) {
+    DirIter it;
+    TreeNode *ch;
     int i;
-    if (dir->child_capacity == 0) {
-        dir->child_capacity = 4;
-        dir->children = (TreeNode **)u_malloc(sizeof(TreeNode *) * dir->child_capacity);
-    } else if (dir->child_count >= dir->child_capacity) {
-        int newcap = dir->child_capacity * 2;
-        TreeNode **nc = (TreeNode **)u_malloc(sizeof(TreeNode *) * newcap);
-        for (i = 0; i < dir->child_count; i++) {
-            nc[i] = dir->children[i];
-        }
-        u_free(dir->children);
-        dir->children = nc;
-        dir->child_capacity = newcap;
+    if (dir->u.dir.index) u_free(dir->u.dir.index);
+    dir->u.dir.index = (FsIndexSlot *)u_malloc(sizeof(FsIndexSlot) * capacity);
+    dir->u.dir.index_capacity = capacity;
+    for (i = 0; i < capacity; i++) dir->u.dir.index[i].node = 0;
+    dt_iter_init(&dir->u.dir.children, &it);
+    while ((ch = dt_iter_next(&it)) != 0) {
+        fs_index_put(dir->u.dir.index, capacity, ch->name->hash, ch);
     }
-    dir->children[dir->child_count++] = child;
+}
+
+/* Index a child already counted in dir->u.dir.count */
+static void fs_index_add(TreeNode *dir, TreeNode *child) {
+    if (!dir->u.dir.index) {
+        if (dir->u.dir.count > FS_INDEX_MIN) fs_index_rebuild(dir, 4 * FS_INDEX_MIN);
+        return;
+    }
+    /* keep the load factor at or below 1/2 */
+    if (dir->u.dir.count * 2 > dir->u.dir.index_capacity) {
+        fs_index_rebuild(dir, dir->u.dir.index_capacity * 2);
+        return;
+    }
+    fs_index_put(dir->u.dir.index, dir->u.dir.index_capacity, child->name->hash, child);
+}
+
+/* Unindex child, shifting later entries of its probe run back so no
+   tombstones are needed */
+static void fs_index_remove(TreeNode *dir, TreeNode *child) {
+    FsIndexSlot *slots = dir->u.dir.index;
+    int mask;
+    int i, j;
+    if (!slots) return;
+    mask = dir->u.dir.index_capacity - 1;
+    i = (int)(child->name->hash & (unsigned int)mask);
+    while (slots[i].node != child) {
+        if (!slots[i].node) return;
+        i = (i + 1) & mask;
+    }
+    j = i;
+    while (1) {
+        int home;
+        j = (j + 1) & mask;
+        if (!slots[j].node) break;
+        home = (int)(slots[j].hash & (unsigned int)mask);
+        /* entries whose home lies cyclically in (i, j] stay put */
+        if (i <= j ? (i < home && home <= j) : (i < home || home <= j)) continue;
+        slots[i] = slots[j];
+        i = j;
+    }
+    slots[i].node = 0;
+}
+
+/* Callers check for a name clash first */
+static void fs_add_child(TreeNode *dir, TreeNode *child) {
+    fs_gen_link++;
+    dt_insert(&dir->u.dir.children, child);
+    dir->u.dir.count++;
     child->parent = dir;
+    fs_index_add(dir, child);
 }
 
+/* Names are interned, so once the name's record is found every compare
+   below is a pointer compare; a name no node uses misses at once. */
 static TreeNode *fs_find_child(TreeNode *dir, const char *name) {
+    unsigned int h;
+    Name *nm;
     int i;
     if (!dir || dir->type != NODE_DIR) return 0;
-    for (i = 0; i < dir->child_count; i++) {
-        if (u_strcmp(dir->children[i]->name, name) == 0) {
-            return dir->children[i];
+    h = name_hash(name);
+    nm = name_find(name, h);
+    if (!nm) return 0;
+    if (dir->u.dir.index) {
+        int mask = dir->u.dir.index_capacity - 1;
+        FsIndexSlot *slots = dir->u.dir.index;
+        i = (int)(h & (unsigned int)mask);
+        while (slots[i].node) {
+            if (slots[i].hash == h && slots[i].node->name == nm) {
+                return slots[i].node;
+            }
+            i = (i + 1) & mask;
         }
+        return 0;
     }
-    return 0;
+    return dt_find(&dir->u.dir.children, nm->str);
 }
 
-static void fs_remove_child(TreeNode *dir, int index) {
-    int i;
-    if (index < 0 || index >= dir->child_count) return;
-    for (i = index; i < dir->child_count - 1; i++) {
-        dir->children[i] = dir->children[i + 1];
+static void fs_remove_child(TreeNode *dir, TreeNode *child) {
+    if (dt_remove(&dir->u.dir.children, child) != 0) return;
+    fs_index_remove(dir, child);
+    dir->u.dir.count--;
+    /* hand the index back as the directory empties */
+    if (dir->u.dir.index && dir->u.dir.count * 8 <= dir->u.dir.index_capacity) {
+        if (dir->u.dir.count <= FS_INDEX_MIN) {
+            u_free(dir->u.dir.index);
+            dir->u.dir.index = 0;
+            dir->u.dir.index_capacity = 0;
+        } else {
+            fs_index_rebuild(dir, dir->u.dir.index_capacity / 2);
+        }
     }
-    dir->child_count--;
 }
 
 static void fs_free_node(TreeNode *n) {
-    int i;
     if (!n) return;
     if (n->type == NODE_DIR) {
-        for (i = 0; i < n->child_count; i++) {
-            fs_free_node(n->children[i]);
+        DirIter it;
+        TreeNode *ch;
+        dt_iter_init(&n->u.dir.children, &it);
+        while ((ch = dt_iter_next(&it)) != 0) {
+            fs_free_node(ch);
         }
-        if (n->children) u_free(n->children);
+        dt_free(&n->u.dir.children);
+        if (n->u.dir.index) u_free(n->u.dir.index);
     } else {
-        if (n->content) u_free(n->content);
+        content_free(&n->u.file);
     }
-    if (n->name) u_free(n->name);
-    u_free(n);
+    name_release(n->name);
+    n->parent = fs_free_nodes;
+    fs_free_nodes = n;
 }
 
-static TreeNode *fs_resolve_relative(TreeNode *start, const char *path) {
+static TreeNode *fs_walk(TreeNode *start, const char *path) {
     int i = 0;
     TreeNode *cur = start;
     char part[256];
@@ -138,16 +299,47 @@ static TreeNode *fs_resolve_relative(TreeNode *start, const char *path) {
     return cur;
 }
 
+static TreeNode *fs_resolve_relative(TreeNode *start, const char *path) {
+    FsDentry *e;
+    unsigned int h;
+    int len;
+    TreeNode *found;
+
+    if (!path || path[0] == 0) return start;
+    len = u_strlen(path);
+    h = name_hash(path) ^ (unsigned int)((uintptr_t)start >> 4) * 2654435761u;
+    e = &fs_dcache[h & (FS_DCACHE_SIZE - 1)];
+    if (e->path && e->hash == h && e->len == len && e->start == start &&
+        e->gen == (e->node ? fs_gen_unlink : fs_gen_link) &&
+        u_strcmp(e->path, path) == 0) {
+        return e->node;
+    }
+    found = fs_walk(start, path);
+    /* refill the slot in place; only a longer path needs a new buffer */
+    if (e->cap < len + 1) {
+        if (e->path) u_free(e->path);
+        e->cap = len + 1 < 32 ? 32 : len + 1;
+        e->path = (char *)u_malloc(e->cap);
+    }
+    u_memcpy(e->path, path, len + 1);
+    e->hash = h;
+    e->len = len;
+    e->start = start;
+    e->node = found;
+    e->gen = found ? fs_gen_unlink : fs_gen_link;
+    return found;
+}
+
 static TreeNode *fs_resolve(const char *path, int parent_for_new, char *last_name) {
     /* parent_for_new: if 1, return parent dir of final component and copy final name into last_name */
-    if (!path || path[0] == 0) return fs_cwd;
+    if (!path || path[0] == 0) return cur_fs->cwd;
     TreeNode *start;
     int offset = 0;
     if (path[0] == '/') {
-        start = fs_root;
+        start = cur_fs->root;
         offset = 1;
     } else {
-        start = fs_cwd;
+        start = cur_fs->cwd;
     }
     if (!parent_for_new) {
         return fs_resolve_relative(start, path + offset);
@@ -177,6 +369,7 @@ static TreeNode *fs_resolve(const char *path, int parent_for_new, char *last_nam
             TreeNode *p;
             char parent_path[512];
             int l = pos - offset;
+            if (l >= (int)sizeof(parent_path)) return 0;
             for (j = 0; j < l; j++) {
                 parent_path[j] = path[offset + j];
             }
@@ -227,21 +420,24 @@ int fs_touch(const char *path) {
 
 int fs_ls(const char *path, char ***names, int *count) {
     TreeNode *dir;
-    int i;
+    DirIter it;
+    TreeNode *ch;
+    int i = 0;
     if (path && path[0] != 0) {
         dir = fs_resolve(path, 0, 0);
     } else {
-        dir = fs_cwd;
+        dir = cur_fs->cwd;
     }
     if (!dir || dir->type != NODE_DIR) return -1;
-    *count = dir->child_count;
-    if (dir->child_count == 0) {
+    *count = dir->u.dir.count;
+    if (dir->u.dir.count == 0) {
         *names = 0;
         return 0;
     }
-    *names = (char **)u_malloc(sizeof(char *) * dir->child_count);
-    for (i = 0; i < dir->child_count; i++) {
-        (*names)[i] = u_strdup(dir->children[i]->name);
+    *names = (char **)req_alloc(sizeof(char *) * dir->u.dir.count);
+    dt_iter_init(&dir->u.dir.children, &it);
+    while ((ch = dt_iter_next(&it)) != 0) {
+        (*names)[i++] = req_strdup(fs_node_name(ch));
     }
     return 0;
 }
@@ -249,212 +445,278 @@ int fs_ls(const char *path, char ***names, int *count) {
 int fs_cd(const char *path) {
     TreeNode *dir;
     if (!path || path[0] == 0) {
-        fs_cwd = fs_root;
+        cur_fs->cwd = cur_fs->root;
         return 0;
     }
     dir = fs_resolve(path, 0, 0);
     if (!dir || dir->type != NODE_DIR) return -1;
-    fs_cwd = dir;
+    cur_fs->cwd = dir;
     return 0;
 }
 
 char *fs_pwd() {
     UBuffer b;
-    TreeNode *cur = fs_cwd;
-    char *parts[128];
+    TreeNode *cur = cur_fs->cwd;
+    const char *parts[128];
     int pc = 0;
     int i;
-    if (cur == fs_root) {
-        char *r = (char *)u_malloc(2);
-        r[0] = '/';
-        r[1] = 0;
-        return r;
-    }
-    while (cur && cur != fs_root) {
-        parts[pc++] = cur->name;
+    if (cur == cur_fs->root) return req_strdup("/");
+    while (cur && cur != cur_fs->root) {
+        parts[pc++] = fs_node_name(cur);
         cur = cur->parent;
     }
-    ubuf_init(&b);
+    ubuf_init_temp(&b);
     ubuf_append_char(&b, '/');
     for (i = pc - 1; i >= 0; i--) {
         ubuf_append_str(&b, parts[i]);
         if (i > 0) ubuf_append_char(&b, '/');
     }
-    return ubuf_to_string(&b);
+    return b.data;
 }
 
-static void fs_ensure_file_buffer(TreeNode *n, int extra) {
-    int need;
-    int newcap;
-    char *nc;
-    int i;
-    if (!n->content) {
-        n->content_capacity = extra + 1;
-        n->content = (char *)u_malloc(n->content_capacity);
-        n->content[0] = 0;
-        n->content_size = 0;
-        return;
-    }
-    need = n->content_size + extra + 1;
-    if (need <= n->content_capacity) return;
-    newcap = n->content_capacity * 2;
-    while (newcap < need) newcap *= 2;
-    nc = (char *)u_malloc(newcap);
-    for (i = 0; i < n->content_size; i++) {
-        nc[i] = n->content[i];
+int fs_write(const char *path, const char *data, int append) {
+    return fs_write_mem(path, data, u_strlen(data), append);
+}
+
+int fs_check_write(const char *path) {
+    char name[256];
+    TreeNode *f = fs_resolve(path, 0, 0);
+    TreeNode *parent;
+    if (f) {
+        if (f->type != NODE_FILE) return -1;
+        return f->perms_write ? 0 : -2;
     }
-    nc[n->content_size] = 0;
-    u_free(n->content);
-    n->content = nc;
-    n->content_capacity = newcap;
+    parent = fs_resolve(path, 1, name);
+    if (!parent || parent->type != NODE_DIR) return -1;
+    return 0;
 }
 
-int fs_write(const char *path, const char *data, int append) {
+/* Writable file at path, created if missing and stamped as modified;
+   0 with *err set if there is none */
+static TreeNode *fs_open_write(const char *path, int *err) {
     TreeNode *f = fs_resolve(path, 0, 0);
-    int len = u_strlen(data);
-    int i;
     if (!f) {
         int r = fs_touch(path);
-        if (r != 0) return r;
+        if (r != 0) {
+            *err = r;
+            return 0;
+        }
         f = fs_resolve(path, 0, 0);
     }
-    if (!f || f->type != NODE_FILE) return -1;
-    if (!f->perms_write) return -2;
-    f->modified_at = fs_get_time();
-    if (!append) {
-        if (!f->content) {
-            f->content_capacity = len + 1;
-            f->content = (char *)u_malloc(f->content_capacity);
-        } else if (f->content_capacity < len + 1) {
-            u_free(f->content);
-            f->content_capacity = len + 1;
-            f->content = (char *)u_malloc(f->content_capacity);
-        }
-        for (i = 0; i < len; i++) {
-            f->content[i] = data[i];
-        }
-        f->content[len] = 0;
-        f->content_size = len;
+    if (!f || f->type != NODE_FILE) {
+        *err = -1;
+        return 0;
+    }
+    if (!f->perms_write) {
+        *err = -2;
+        return 0;
+    }
+    f->modified_at = (unsigned int)fs_get_time();
+    f->version = fs_next_version++;
+    return f;
+}
+
+int fs_write_mem(const char *path, const char *data, int len, int append) {
+    int err;
+    TreeNode *f = fs_open_write(path, &err);
+    if (!f) return err;
+    if (append) {
+        content_append(&f->u.file, data, len);
     } else {
-        fs_ensure_file_buffer(f, len);
-        for (i = 0; i < len; i++) {
-            f->content[f->content_size + i] = data[i];
-        }
-        f->content_size += len;
-        f->content[f->content_size] = 0;
+        content_set(&f->u.file, data, len);
+    }
+    return 0;
+}
+
+int fs_write_at(const char *path, int off, const char *data, int len, int insert) {
+    int err;
+    TreeNode *f = fs_resolve(path, 0, 0);
+    if (f && f->type == NODE_FILE && (off < 0 || off > f->u.file.size)) return -3;
+    if (!f && off != 0) return -3;
+    f = fs_open_write(path, &err);
+    if (!f) return err;
+    if (insert) {
+        content_insert(&f->u.file, off, data, len);
+    } else {
+        content_write_at(&f->u.file, off, data, len);
     }
     return 0;
 }
 
+int fs_truncate(const char *path, int size) {
+    TreeNode *f = fs_resolve(path, 0, 0);
+    if (!f || f->type != NODE_FILE) return -1;
+    if (!f->perms_write) return -2;
+    if (size < 0 || size > f->u.file.size) return -3;
+    f->modified_at = (unsigned int)fs_get_time();
+    f->version = fs_next_version++;
+    content_truncate(&f->u.file, size);
+    return 0;
+}
+
+int fs_snapshot(const char *path, Content *out) {
+    TreeNode *f = fs_resolve(path, 0, 0);
+    if (!f || f->type != NODE_FILE) return -1;
+    content_share(out, &f->u.file);
+    return 0;
+}
+
+int fs_restore(const char *path, const Content *data) {
+    int err;
+    TreeNode *f = fs_open_write(path, &err);
+    if (!f) return err;
+    content_share(&f->u.file, data);
+    return 0;
+}
+
+/* Readable file at path, or 0 */
+static TreeNode *fs_open_read(const char *path) {
+    TreeNode *f = fs_resolve(path, 0, 0);
+    if (!f || f->type != NODE_FILE || !f->perms_read) return 0;
+    return f;
+}
+
+/* Request-arena copy of bytes [start, end) of f */
+static char *fs_copy_range(TreeNode *f, int start, int end, int *out_len) {
+    char *out = (char *)req_alloc(end - start + 1);
+    content_read(&f->u.file, start, end - start, out);
+    out[end - start] = 0;
+    if (out_len) *out_len = end - start;
+    return out;
+}
+
+char *fs_read_range(const char *path, int off, int len, int *out_len) {
+    TreeNode *f = fs_open_read(path);
+    int size;
+    if (!f) return 0;
+    size = f->u.file.size;
+    if (off < 0) off = 0;
+    if (off > size) off = size;
+    if (len < 0 || len > size - off) len = size - off;
+    return fs_copy_range(f, off, off + len, out_len);
+}
+
+char *fs_read_lines(const char *path, int first, int last, int *out_len) {
+    TreeNode *f = fs_open_read(path);
+    int start;
+    int end = -1;
+    if (!f) return 0;
+    start = content_line_start(&f->u.file, first);
+    if (start < 0 || (last >= 0 && last < first)) return fs_copy_range(f, 0, 0, out_len);
+    if (last >= 0) end = content_line_start(&f->u.file, last + 1);
+    if (end < 0) end = f->u.file.size;
+    return fs_copy_range(f, start, end, out_len);
+}
+
+char *fs_read_tail(const char *path, int n, int *out_len) {
+    TreeNode *f = fs_open_read(path);
+    if (!f) return 0;
+    return fs_copy_range(f, content_tail_start(&f->u.file, n), f->u.file.size, out_len);
+}
+
 char *fs_read(const char *path) {
     TreeNode *f = fs_resolve(path, 0, 0);
-    char *copy;
-    int i;
+    char *out;
     if (!f || f->type != NODE_FILE) return 0;
     if (!f->perms_read) return 0;
-    if (!f->content) {
-        copy = (char *)u_malloc(1);
-        copy[0] = 0;
-        return copy;
-    }
-    copy = (char *)u_malloc(f->content_size + 1);
-    for (i = 0; i < f->content_size; i++) {
-        copy[i] = f->content[i];
-    }
-    copy[f->content_size] = 0;
-    return copy;
+    out = (char *)req_alloc(f->u.file.size + 1);
+    content_read(&f->u.file, 0, f->u.file.size, out);
+    out[f->u.file.size] = 0;
+    return out;
 }
 
 int fs_rm(const char *path) {
     TreeNode *f = fs_resolve(path, 0, 0);
     TreeNode *p;
-    int i;
     if (!f || f->type != NODE_FILE) return -1;
     p = f->parent;
     if (!p) return -2;
-    for (i = 0; i < p->child_count; i++) {
-        if (p->children[i] == f) {
-            fs_remove_child(p, i);
-            fs_free_node(f);
-            return 0;
-        }
-    }
-    return -3;
+    fs_gen_unlink++;
+    fs_remove_child(p, f);
+    fs_free_node(f);
+    return 0;
 }
 
 int fs_rmdir(const char *path) {
     TreeNode *d = fs_resolve(path, 0, 0);
     TreeNode *p;
-    int i;
     if (!d || d->type != NODE_DIR) return -1;
-    if (d == fs_root) return -2;
-    if (d->child_count > 0) return -3;
+    if (d == cur_fs->root || d == cur_fs->cwd) return -2;
+    if (d->u.dir.count > 0) return -3;
     p = d->parent;
     if (!p) return -4;
-    for (i = 0; i < p->child_count; i++) {
-        if (p->children[i] == d) {
-            fs_remove_child(p, i);
-            fs_free_node(d);
-            return 0;
+    fs_gen_unlink++;
+    fs_remove_child(p, d);
+    fs_free_node(d);
+    return 0;
+}
+
+static void fs_search_line(const char *path, int line, const char *text,
+                           const char *keyword, int klen,
+                           FsSearchCallback cb, void *user) {
+    int l = u_strlen(text);
+    int j;
+    for (j = 0; j + klen <= l; j++) {
+        int ok = 1;
+        int t;
+        for (t = 0; t < klen; t++) {
+            if (text[j + t] != keyword[t]) {
+                ok = 0;
+                break;
+            }
+        }
+        if (ok) {
+            cb(path, line, text, user);
+            return;
         }
     }
-    return -5;
 }
 
+/* Lines are gathered chunk by chunk; only a line that straddles a chunk
+   boundary is copied more than once */
 static void fs_search_in_file(const char *path, TreeNode *f,
                               const char *keyword,
                               FsSearchCallback cb, void *user) {
-    int i = 0;
     int line = 1;
+    int k;
     UBuffer linebuf;
     int klen = u_strlen(keyword);
-    if (!f->content || klen == 0) return;
+    if (f->u.file.size == 0 || klen == 0) return;
     ubuf_init(&linebuf);
-    while (i <= f->content_size) {
-        char c = (i == f->content_size) ? '\n' : f->content[i];
-        if (c == '\n') {
-            char *line_str = ubuf_to_string(&linebuf);
-            int j;
-            int l = u_strlen(line_str);
-            for (j = 0; j + klen <= l; j++) {
-                int ok = 1;
-                int t;
-                for (t = 0; t < klen; t++) {
-                    if (line_str[j + t] != keyword[t]) {
-                        ok = 0;
-                        break;
-                    }
-                }
-                if (ok) {
-                    cb(path, line, line_str, user);
-                    break;
-                }
-            }
-            u_free(line_str);
+    for (k = 0; k < f->u.file.count; k++) {
+        const char *c;
+        int n = content_chunk(&f->u.file, k, &c);
+        int start = 0;
+        int i;
+        for (i = 0; i < n; i++) {
+            if (c[i] != '\n') continue;
+            ubuf_append_mem(&linebuf, c + start, i - start);
+            fs_search_line(path, line, linebuf.data, keyword, klen, cb, user);
             line++;
             linebuf.length = 0;
             linebuf.data[0] = 0;
-        } else {
-            ubuf_append_char(&linebuf, c);
+            start = i + 1;
         }
-        i++;
+        ubuf_append_mem(&linebuf, c + start, n - start);
     }
+    fs_search_line(path, line, linebuf.data, keyword, klen, cb, user);
     ubuf_free(&linebuf);
 }
 
 static void fs_search_rec(TreeNode *dir, const char *prefix,
                           const char *keyword,
                           FsSearchCallback cb, void *user) {
-    int i;
+    DirIter it;
+    TreeNode *ch;
     char path[512];
     if (!dir) return;
-    for (i = 0; i < dir->child_count; i++) {
-        TreeNode *ch = dir->children[i];
+    dt_iter_init(&dir->u.dir.children, &it);
+    while ((ch = dt_iter_next(&it)) != 0) {
         if (prefix[0] == 0 || (prefix[0] == '/' && prefix[1] == 0)) {
             path[0] = '/';
             path[1] = 0;
-            if (ch != fs_root) {
-                u_strcat(path, ch->name);
+            if (ch != cur_fs->root) {
+                u_strcat(path, fs_node_name(ch));
             }
         } else {
             int plen = u_strlen(prefix);
@@ -469,8 +731,8 @@ static void fs_search_rec(TreeNode *dir, const char *prefix,
                 }
             }
             path[plen] = 0;
-            if (u_strlen(path) + u_strlen(ch->name) < 511) {
-                u_strcat(path, ch->name);
+            if (u_strlen(path) + u_strlen(fs_node_name(ch)) < 511) {
+                u_strcat(path, fs_node_name(ch));
             }
         }
         if (ch->type == NODE_FILE) {
@@ -489,9 +751,9 @@ void fs_search(const char *start_path, const char *keyword,
     rootpath[1] = 0;
     if (start_path && start_path[0] != 0) {
         start = fs_resolve(start_path, 0, 0);
-        if (!start) start = fs_root;
+        if (!start) start = cur_fs->root;
     } else {
-        start = fs_root;
+        start = cur_fs->root;
     }
     if (start->type == NODE_FILE) {
         fs_search_in_file(rootpath, start, keyword, cb, user);
@@ -508,33 +770,95 @@ int fs_chmod(const char *path, int readable, int writable) {
     return 0;
 }
 
-int fs_copy(const char *src_path, const char *dst_path) {
+/* A detached copy of the subtree at n, named name. Files share their
+   chunks with the originals; names and permissions carry over. */
+static TreeNode *fs_clone(const TreeNode *n, const char *name) {
+    TreeNode *c = fs_create_node(name, n->type);
+    c->perms_read = n->perms_read;
+    c->perms_write = n->perms_write;
+    if (n->type == NODE_FILE) {
+        content_share(&c->u.file, &n->u.file);
+    } else {
+        DirIter it;
+        TreeNode *ch;
+        dt_iter_init(&n->u.dir.children, &it);
+        while ((ch = dt_iter_next(&it)) != 0) {
+            fs_add_child(c, fs_clone(ch, fs_node_name(ch)));
+        }
+    }
+    return c;
+}
+
+/* Parent directory for a new entry at path, with its name in name;
+   0 if there is none or the name cannot be an entry */
+static TreeNode *fs_resolve_new(const char *path, char *name) {
+    TreeNode *parent = fs_resolve(path, 1, name);
+    if (!parent || parent->type != NODE_DIR) return 0;
+    if (name[0] == 0 || u_strcmp(name, ".") == 0 || u_strcmp(name, "..") == 0) return 0;
+    return parent;
+}
+
+int fs_copy(const char *src_path, const char *dst_path, int recursive) {
     TreeNode *src = fs_resolve(src_path, 0, 0);
+    TreeNode *parent;
+    TreeNode *p;
+    char name[256];
     if (!src) return -1;
     if (src->type == NODE_FILE) {
-        char *content = fs_read(src_path);
-        int rc;
-        if (!content) return -2;
-        rc = fs_write(dst_path, content, 0);
-        u_free(content);
-        return rc;
-    } else {
-        /* simple: create dir only, not deep copy of children */
+        if (!src->perms_read) return -2;
+        /* the copy shares src's chunks until one side is written */
+        return fs_restore(dst_path, &src->u.file);
+    }
+    if (!recursive) {
+        /* without -r only the directory itself is created */
         return fs_mkdir(dst_path);
     }
+    parent = fs_resolve_new(dst_path, name);
+    if (!parent) return -1;
+    /* as for fs_move, the destination may not be inside the source */
+    for (p = parent; p; p = p->parent) {
+        if (p == src) return -3;
+    }
+    if (fs_find_child(parent, name)) return -2;
+    fs_add_child(parent, fs_clone(src, name));
+    return 0;
 }
 
+/*
+ * Detach src and attach it under dst's parent as dst's name. The subtree
+ * moves with it untouched, so this costs the same for one file as for a
+ * whole project. An existing file at dst is replaced by a file; anything
+ * else already there is an error, as is moving a directory into itself.
+ */
 int fs_move(const char *src_path, const char *dst_path) {
     TreeNode *src = fs_resolve(src_path, 0, 0);
-    int rc;
+    TreeNode *parent;
+    TreeNode *exist;
+    TreeNode *p;
+    char name[256];
     if (!src) return -1;
-    rc = fs_copy(src_path, dst_path);
-    if (rc != 0) return rc;
-    if (src->type == NODE_FILE) {
-        return fs_rm(src_path);
-    } else {
-        return fs_rmdir(src_path);
+    if (src == cur_fs->root) return -3;
+    parent = fs_resolve_new(dst_path, name);
+    if (!parent) return -1;
+    for (p = parent; p; p = p->parent) {
+        if (p == src) return -3;
+    }
+    exist = fs_find_child(parent, name);
+    if (exist == src) return 0;
+    if (exist) {
+        if (src->type != NODE_FILE || exist->type != NODE_FILE) return -2;
+        if (!exist->perms_write) return -2;
     }
+    fs_gen_unlink++;
+    if (exist) {
+        fs_remove_child(parent, exist);
+        fs_free_node(exist);
+    }
+    fs_remove_child(src->parent, src);
+    if (u_strcmp(fs_node_name(src), name) != 0) fs_set_name(src, name);
+    fs_add_child(parent, src);
+    src->modified_at = (unsigned int)fs_get_time();
+    return 0;
 }
 
 int fs_rename(const char *path, const char *new_name) {
@@ -542,7 +866,7 @@ int fs_rename(const char *path, const char *new_name) {
     TreeNode *parent;
     TreeNode *exist;
     int i;
-    
+
     /* Validate new_name doesn't contain / */
     for (i = 0; new_name[i] != 0; i++) {
         if (new_name[i] == '/') return -1;
@@ -550,90 +874,80 @@ int fs_rename(const char *path, const char *new_name) {
     
     node = fs_resolve(path, 0, 0);
     if (!node) return -2;
-    if (node == fs_root) return -3; /* Cannot rename root */
+    if (node == cur_fs->root) return -3; /* Cannot rename root */
     
     parent = node->parent;
     if (!parent) return -4;
     
     /* Check if name already exists in same directory */
-    for (i = 0; i < parent->child_count; i++) {
-        if (parent->children[i] != node && 
-            u_strcmp(parent->children[i]->name, new_name) == 0) {
-            exist = parent->children[i];
-            return -5; /* Name already exists */
-        }
+    exist = fs_find_child(parent, new_name);
+    if (exist && exist != node) return -5; /* Name already exists */
+
+    /* Update the name, re-filing it in the parent's tree and index */
+    fs_gen_unlink++;
+    fs_gen_link++;
+    dt_remove(&parent->u.dir.children, node);
+    fs_index_remove(parent, node);
+    fs_set_name(node, new_name);
+    dt_insert(&parent->u.dir.children, node);
+    if (parent->u.dir.index) {
+        fs_index_put(parent->u.dir.index, parent->u.dir.index_capacity, node->name->hash, node);
     }
-    
-    /* Update the name */
-    u_free(node->name);
-    node->name = u_strdup(new_name);
-    node->modified_at = fs_get_time();
+    node->modified_at = (unsigned int)fs_get_time();
     
     return 0;
 }
 
+/* Preorder, children in name order, so a parent always precedes its
+   entries when the file is imported again */
+static void fs_export_rec(FILE *f, TreeNode *n, UBuffer *path) {
+    int i, k;
+    if (n->type == NODE_DIR) {
+        DirIter it;
+        TreeNode *ch;
+        int len = path->length;
+        fprintf(f, "DIR:%s:%d:%d\n", path->data, n->perms_read, n->perms_write);
+        dt_iter_init(&n->u.dir.children, &it);
+        while ((ch = dt_iter_next(&it)) != 0) {
+            if (len > 1) ubuf_append_char(path, '/');
+            ubuf_append_str(path, fs_node_name(ch));
+            fs_export_rec(f, ch, path);
+            path->length = len;
+            path->data[len] = 0;
+        }
+        return;
+    }
+    fprintf(f, "FILE:%s:%d:%d:", path->data, n->perms_read, n->perms_write);
+    for (k = 0; k < n->u.file.count; k++) {
+        const char *data;
+        int len = content_chunk(&n->u.file, k, &data);
+        for (i = 0; i < len; i++) {
+            char c = data[i];
+            if (c == '\n') {
+                fputc('\\', f);
+                fputc('n', f);
+            } else if (c == '\\') {
+                fputc('\\', f);
+                fputc('\\', f);
+            } else {
+                fputc(c, f);
+            }
+        }
+    }
+    fputc('\n', f);
+}
+
 void fs_export_to_file(const char *filename, int *status) {
     FILE *f = fopen(filename, "w");
-    int i;
+    UBuffer path;
     if (!f) {
         if (status) *status = -1;
         return;
     }
-    /* Files and dirs DFS */
-    /* helper stack of nodes */
-    TreeNode *stack[256];
-    char *pathstack[256];
-    int sp = 0;
-    stack[sp] = fs_root;
-    pathstack[sp] = "/";
-    sp++;
-    while (sp > 0) {
-        TreeNode *n;
-        char *path;
-        sp--;
-        n = stack[sp];
-        path = pathstack[sp];
-        if (n->type == NODE_DIR) {
-            fprintf(f, "DIR:%s:%d:%d\n", path, n->perms_read, n->perms_write);
-        } else {
-            fprintf(f, "FILE:%s:%d:%d:", path, n->perms_read, n->perms_write);
-            if (n->content) {
-                for (i = 0; i < n->content_size; i++) {
-                    char c = n->content[i];
-                    if (c == '\n') {
-                        fputc('\\', f);
-                        fputc('n', f);
-                    } else if (c == '\\') {
-                        fputc('\\', f);
-                        fputc('\\', f);
-                    } else {
-                        fputc(c, f);
-                    }
-                }
-            }
-            fputc('\n', f);
-        }
-        if (n->type == NODE_DIR) {
-            for (i = 0; i < n->child_count; i++) {
-                TreeNode *ch = n->children[i];
-                char *child_path;
-                UBuffer pb;
-                ubuf_init(&pb);
-                if (path[0] == '/' && path[1] == 0) {
-                    ubuf_append_char(&pb, '/');
-                    ubuf_append_str(&pb, ch->name);
-                } else {
-                    ubuf_append_str(&pb, path);
-                    ubuf_append_char(&pb, '/');
-                    ubuf_append_str(&pb, ch->name);
-                }
-                child_path = ubuf_to_string(&pb);
-                stack[sp] = ch;
-                pathstack[sp] = child_path;
-                sp++;
-            }
-        }
-    }
+    ubuf_init(&path);
+    ubuf_append_char(&path, '/');
+    fs_export_rec(f, cur_fs->root, &path);
+    ubuf_free(&path);
     fprintf(f, "END\n");
     fclose(f);
     if (status) *status = 0;
@@ -676,7 +990,8 @@ void fs_import_from_file(const char *filename, int *status) {
             if (line[i] != ':') continue;
             i++;
             wbit = line[i] - '0';
-            fs_mkdir(path);
+            /* the root line only carries its permissions */
+            if (!(path[0] == '/' && path[1] == 0)) fs_mkdir(path);
             fs_chmod(path, rbit, wbit);
         } else if (kind[0] == 'F') {
             char path[512];
@@ -722,10 +1037,12 @@ void fs_import_from_file(const char *filename, int *status) {
 }
 
 void fs_clear() {
-    if (fs_root) {
-        fs_free_node(fs_root);
-        fs_root = 0;
-        fs_cwd = 0;
+    if (cur_fs->root) {
+        fs_gen_unlink++;
+        fs_gen_link++;
+        fs_free_node(cur_fs->root);
+        cur_fs->root = 0;
+        cur_fs->cwd = 0;
     }
 }
 
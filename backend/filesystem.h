@@ -1,39 +1,89 @@
 #ifndef FILESYSTEM_H
 #define FILESYSTEM_H
 
+#include "content.h"
+#include "dirtree.h"
+#include "nametable.h"
+
 typedef enum {
     NODE_FILE,
     NODE_DIR
 } NodeType;
 
+/*
+ * Nodes come from a slab allocator in filesystem.c and are recycled when
+ * freed, so the layout is kept tight: one-bit flags, a union of the file
+ * and directory fields, 32-bit timestamps, and the name as a pointer
+ * into the interned name table (nametable.h).
+ */
 typedef struct TreeNode {
-    char *name;
-    NodeType type;
-    char *content;
-    int content_size;
-    int content_capacity;
-    int perms_read;
-    int perms_write;
-    struct TreeNode **children;
-    int child_count;
-    int child_capacity;
     struct TreeNode *parent;
-    unsigned long long created_at;
-    unsigned long long modified_at;
+    /* bumped on every content change, never reused by another node
+       (modified_at only has one-second resolution) */
+    unsigned long long version;
+    union {
+        Content file;
+        struct {
+            DirTree children;  /* kept sorted by name */
+            /* name -> child hash index, kept once a directory holds
+               more than FS_INDEX_MIN children (0 before that) */
+            struct FsIndexSlot *index;
+            int count;
+            int index_capacity;
+        } dir;
+    } u;
+    unsigned int created_at;   /* seconds since the epoch */
+    unsigned int modified_at;
+    unsigned int type : 1;     /* NodeType */
+    unsigned int perms_read : 1;
+    unsigned int perms_write : 1;
+    Name *name;
 } TreeNode;
 
+/* Per-session filesystem: everything below operates on the bound state */
+typedef struct {
+    TreeNode *root;
+    TreeNode *cwd;
+} FsState;
+
+void fs_bind(FsState *st);
+
 void fs_init();
+const char *fs_node_name(const TreeNode *n);
 TreeNode *fs_get_root();
 TreeNode *fs_get_cwd();
 void fs_set_cwd(TreeNode *n);
 
 int fs_mkdir(const char *path);
 int fs_touch(const char *path);
+/* fs_ls, fs_pwd and fs_read return copies in the request arena (arena.h) */
 int fs_ls(const char *path, char ***names, int *count);
 int fs_cd(const char *path);
 char *fs_pwd();
 int fs_write(const char *path, const char *data, int append);
+/* fs_write for len bytes of data, which may contain NULs */
+int fs_write_mem(const char *path, const char *data, int len, int append);
+/* 0 if fs_write on path would succeed: a writable file, or a missing
+   one whose parent is a directory. Changes nothing. */
+int fs_check_write(const char *path);
 char *fs_read(const char *path);
+/* Partial reads, also copies in the request arena. len bytes from off
+   (clamped to the file); 1-based lines first..last inclusive, last < 0
+   meaning to the end; the last n lines. *out_len gets the length. */
+char *fs_read_range(const char *path, int off, int len, int *out_len);
+char *fs_read_lines(const char *path, int first, int last, int *out_len);
+char *fs_read_tail(const char *path, int n, int *out_len);
+/* Overwrite (or, with insert, insert) len bytes at off, which may be at
+   most the file size; -3 if it is past the end */
+int fs_write_at(const char *path, int off, const char *data, int len, int insert);
+/* Cut a file down to size bytes; -3 if that is past the end */
+int fs_truncate(const char *path, int size);
+/* Copy-on-write snapshots: fs_snapshot shares a file's content into out
+   (ignoring read permission, for undo); fs_restore makes a file's content
+   a shared copy of data, creating the file if needed. Both cost one
+   pointer per chunk, not the file's size. */
+int fs_snapshot(const char *path, Content *out);
+int fs_restore(const char *path, const Content *data);
 int fs_rm(const char *path);
 int fs_rmdir(const char *path);
 
@@ -44,7 +94,10 @@ void fs_search(const char *start_path, const char *keyword,
 
 int fs_chmod(const char *path, int readable, int writable);
 TreeNode *fs_find_node(const char *path);
-int fs_copy(const char *src_path, const char *dst_path);
+/* Copy a file (sharing its content) or, with recursive, a whole
+   directory tree; without it a directory copy is just a new empty one */
+int fs_copy(const char *src_path, const char *dst_path, int recursive);
+/* Re-attach src at dst in O(1), whatever the size of its subtree */
 int fs_move(const char *src_path, const char *dst_path);
 int fs_rename(const char *path, const char *new_name);
 void fs_export_to_file(const char *filename, int *status);
@@ -1,5 +1,6 @@
 #include "hashmap.h"
 #include "utils.h"
+#include "arena.h"
 
 static unsigned long hm_hash(const char *s) {
     unsigned long h = 5381;
@@ -13,6 +14,16 @@ static unsigned long hm_hash(const char *s) {
     return h;
 }
 
+/* hm_hash of the first n bytes of s */
+static unsigned long hm_hash_n(const char *s, int n) {
+    unsigned long h = 5381;
+    int i;
+    for (i = 0; i < n; i++) {
+        h = ((h << 5) + h) + s[i];
+    }
+    return h;
+}
+
 void hm_init(HashMap *map, int bucket_count) {
     int i;
     map->bucket_count = bucket_count;
@@ -60,6 +71,19 @@ char *hm_get(HashMap *map, const char *key) {
     return 0;
 }
 
+char *hm_get_n(HashMap *map, const char *key, int n) {
+    unsigned long h = hm_hash_n(key, n);
+    int idx = (int)(h % map->bucket_count);
+    VarEntry *e = map->buckets[idx];
+    while (e) {
+        if (u_strncmp(e->key, key, n) == 0 && e->key[n] == 0) {
+            return e->value;
+        }
+        e = e->next;
+    }
+    return 0;
+}
+
 void hm_unset(HashMap *map, const char *key) {
     unsigned long h = hm_hash(key);
     int idx = (int)(h % map->bucket_count);
@@ -98,13 +122,13 @@ void hm_list(HashMap *map, char ***pairs, int *count) {
         *count = 0;
         return;
     }
-    arr = (char **)u_malloc(sizeof(char *) * total);
+    arr = (char **)req_alloc(sizeof(char *) * total);
     for (i = 0; i < map->bucket_count; i++) {
         e = map->buckets[i];
         while (e) {
             int lenk = u_strlen(e->key);
             int lenv = u_strlen(e->value);
-            char *s = (char *)u_malloc(lenk + 1 + lenv + 1);
+            char *s = (char *)req_alloc(lenk + 1 + lenv + 1);
             int j;
             for (j = 0; j < lenk; j++) s[j] = e->key[j];
             s[lenk] = '=';
@@ -118,3 +142,19 @@ void hm_list(HashMap *map, char ***pairs, int *count) {
     *count = total;
 }
 
+void hm_free(HashMap *map) {
+    int i;
+    for (i = 0; i < map->bucket_count; i++) {
+        VarEntry *e = map->buckets[i];
+        while (e) {
+            VarEntry *next = e->next;
+            if (e->key) u_free(e->key);
+            if (e->value) u_free(e->value);
+            u_free(e);
+            e = next;
+        }
+    }
+    if (map->buckets) u_free(map->buckets);
+    map->buckets = 0;
+    map->bucket_count = 0;
+}
@@ -15,8 +15,12 @@ typedef struct {
 void hm_init(HashMap *map, int bucket_count);
 void hm_set(HashMap *map, const char *key, const char *value);
 char *hm_get(HashMap *map, const char *key);
+/* hm_get for a key given as n bytes, not NUL-terminated */
+char *hm_get_n(HashMap *map, const char *key, int n);
 void hm_unset(HashMap *map, const char *key);
+/* "key=value" strings, in the request arena (see arena.h) */
 void hm_list(HashMap *map, char ***pairs, int *count);
+void hm_free(HashMap *map);
 
 #endif
 
@@ -1,14 +1,34 @@
 #include "history.h"
 #include "utils.h"
+#include "arena.h"
 
-static HistoryList hist;
-static HistoryNode *hist_cursor = 0;  /* Cursor for navigation */
+static HistoryState hist_default;
+static HistoryState *cur_hist = &hist_default;
+
+void history_bind(HistoryState *st) {
+    cur_hist = st ? st : &hist_default;
+}
 
 void history_init(int max_size) {
-    hist.head = 0;
-    hist.tail = 0;
-    hist.size = 0;
-    hist.max_size = max_size;
+    cur_hist->list.head = 0;
+    cur_hist->list.tail = 0;
+    cur_hist->list.size = 0;
+    cur_hist->list.max_size = max_size;
+    cur_hist->cursor = 0;
+}
+
+void history_clear() {
+    HistoryNode *cur = cur_hist->list.head;
+    while (cur) {
+        HistoryNode *next = cur->next;
+        if (cur->command) u_free(cur->command);
+        u_free(cur);
+        cur = next;
+    }
+    cur_hist->list.head = 0;
+    cur_hist->list.tail = 0;
+    cur_hist->list.size = 0;
+    cur_hist->cursor = 0;
 }
 
 void history_add(const char *cmd) {
@@ -16,34 +36,36 @@ void history_add(const char *cmd) {
     if (!cmd || cmd[0] == 0) return;
     n = (HistoryNode *)u_malloc(sizeof(HistoryNode));
     n->command = u_strdup(cmd);
-    n->prev = hist.tail;
+    n->prev = cur_hist->list.tail;
     n->next = 0;
-    if (!hist.head) hist.head = n;
-    if (hist.tail) hist.tail->next = n;
-    hist.tail = n;
-    hist.size++;
-    if (hist.size > hist.max_size) {
-        HistoryNode *old = hist.head;
-        hist.head = old->next;
-        if (hist.head) hist.head->prev = 0;
+    if (!cur_hist->list.head) cur_hist->list.head = n;
+    if (cur_hist->list.tail) cur_hist->list.tail->next = n;
+    cur_hist->list.tail = n;
+    cur_hist->list.size++;
+    if (cur_hist->list.size > cur_hist->list.max_size) {
+        HistoryNode *old = cur_hist->list.head;
+        cur_hist->list.head = old->next;
+        if (cur_hist->list.head) cur_hist->list.head->prev = 0;
+        /* don't leave the navigation cursor on the evicted entry */
+        if (cur_hist->cursor == old) cur_hist->cursor = cur_hist->list.head;
         if (old->command) u_free(old->command);
         u_free(old);
-        hist.size--;
+        cur_hist->list.size--;
     }
 }
 
 int history_get_all(char ***out, int *count) {
-    HistoryNode *cur = hist.head;
-    int c = hist.size;
+    HistoryNode *cur = cur_hist->list.head;
+    int c = cur_hist->list.size;
     int i = 0;
     if (c == 0) {
         *out = 0;
         *count = 0;
         return 0;
     }
-    *out = (char **)u_malloc(sizeof(char *) * c);
+    *out = (char **)req_alloc(sizeof(char *) * c);
     while (cur) {
-        (*out)[i++] = u_strdup(cur->command);
+        (*out)[i++] = req_strdup(cur->command);
         cur = cur->next;
     }
     *count = c;
@@ -51,38 +73,38 @@ int history_get_all(char ***out, int *count) {
 }
 
 char *history_prev() {
-    if (hist.size == 0) return 0;
+    if (cur_hist->list.size == 0) return 0;
     
-    if (hist_cursor == 0) {
+    if (cur_hist->cursor == 0) {
         /* Start from tail (most recent) */
-        hist_cursor = hist.tail;
-    } else if (hist_cursor->prev != 0) {
+        cur_hist->cursor = cur_hist->list.tail;
+    } else if (cur_hist->cursor->prev != 0) {
         /* Move to previous (older) */
-        hist_cursor = hist_cursor->prev;
+        cur_hist->cursor = cur_hist->cursor->prev;
     }
     /* else stay at current (oldest) */
     
-    if (hist_cursor) {
-        return u_strdup(hist_cursor->command);
+    if (cur_hist->cursor) {
+        return req_strdup(cur_hist->cursor->command);
     }
     return 0;
 }
 
 char *history_next() {
-    if (hist.size == 0 || hist_cursor == 0) {
+    if (cur_hist->list.size == 0 || cur_hist->cursor == 0) {
         return 0; /* No history or already at end */
     }
     
-    if (hist_cursor->next != 0) {
-        hist_cursor = hist_cursor->next;
-        return u_strdup(hist_cursor->command);
+    if (cur_hist->cursor->next != 0) {
+        cur_hist->cursor = cur_hist->cursor->next;
+        return req_strdup(cur_hist->cursor->command);
     } else {
         /* At the end, reset cursor and return empty */
-        hist_cursor = 0;
-        return u_strdup("");
+        cur_hist->cursor = 0;
+        return req_strdup("");
     }
 }
 
 void history_reset_cursor() {
-    hist_cursor = 0;
+    cur_hist->cursor = 0;
 }
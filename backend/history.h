@@ -14,8 +14,18 @@ typedef struct {
     int max_size;
 } HistoryList;
 
+/* Per-session history: everything below operates on the bound state */
+typedef struct {
+    HistoryList list;
+    HistoryNode *cursor;  /* navigation position for prev/next */
+} HistoryState;
+
+void history_bind(HistoryState *st);
+
 void history_init(int max_size);
+void history_clear();
 void history_add(const char *cmd);
+/* These return copies in the request arena (see arena.h) */
 int history_get_all(char ***out, int *count);
 char *history_prev();
 char *history_next();
@@ -0,0 +1,143 @@
+#include "json.h"
+#include "utils.h"
+
+#if defined(__SSE2__) && defined(__GNUC__)
+#include <emmintrin.h>
+#define JSON_SSE2 1
+#elif defined(__GNUC__)
+#define JSON_SWAR 1
+#endif
+
+/*
+ * Escaping is the hot part of every reply, so text is handled in runs:
+ * find the next byte that needs escaping 16 (SSE2) or 8 (word-at-a-time)
+ * bytes per step, copy everything before it in one go, escape that byte.
+ *
+ * A byte needs escaping if it is '"', '\\' or a control byte below 0x20.
+ */
+
+static const char json_hex[] = "0123456789abcdef";
+
+static int json_special(unsigned char c) {
+    return c < 0x20 || c == '"' || c == '\\';
+}
+
+#ifdef JSON_SSE2
+static int json_block_mask(__m128i v) {
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i bslash = _mm_set1_epi8('\\');
+    const __m128i ctrl = _mm_set1_epi8(0x1f);
+    /* max(v, 0x1f) == 0x1f exactly when v <= 0x1f (unsigned) */
+    __m128i hit = _mm_or_si128(_mm_cmpeq_epi8(v, quote),
+                               _mm_cmpeq_epi8(v, bslash));
+    hit = _mm_or_si128(hit, _mm_cmpeq_epi8(_mm_max_epu8(v, ctrl), ctrl));
+    return _mm_movemask_epi8(hit);
+}
+#endif
+
+#ifdef JSON_SWAR
+typedef unsigned long long __attribute__((__may_alias__, __aligned__(1))) json_word;
+
+#define JSON_ONES 0x0101010101010101ULL
+#define JSON_HIGHS 0x8080808080808080ULL
+
+/* Nonzero if any byte of w is special (may over-report past the first hit) */
+static unsigned long long json_word_special(unsigned long long w) {
+    unsigned long long q = w ^ (JSON_ONES * '"');
+    unsigned long long b = w ^ (JSON_ONES * '\\');
+    return (((q - JSON_ONES) & ~q) |
+            ((b - JSON_ONES) & ~b) |
+            ((w - JSON_ONES * 0x20) & ~w)) & JSON_HIGHS;
+}
+#endif
+
+/* Number of leading bytes of s[0..len) that can be copied verbatim */
+static int json_clean_run(const unsigned char *s, int len) {
+    int i = 0;
+#ifdef JSON_SSE2
+    while (i + 16 <= len) {
+        int mask = json_block_mask(_mm_loadu_si128((const __m128i *)(s + i)));
+        if (mask) return i + __builtin_ctz((unsigned int)mask);
+        i += 16;
+    }
+#elif defined(JSON_SWAR)
+    while (i + 8 <= len) {
+        if (json_word_special(*(const json_word *)(s + i))) break;
+        i += 8;
+    }
+#endif
+    while (i < len && !json_special(s[i])) i++;
+    return i;
+}
+
+static void json_append_escape(UBuffer *out, unsigned char c) {
+    char seq[6];
+    seq[0] = '\\';
+    switch (c) {
+    case '"': seq[1] = '"'; break;
+    case '\\': seq[1] = '\\'; break;
+    case '\n': seq[1] = 'n'; break;
+    case '\r': seq[1] = 'r'; break;
+    case '\t': seq[1] = 't'; break;
+    case '\b': seq[1] = 'b'; break;
+    case '\f': seq[1] = 'f'; break;
+    default:
+        seq[1] = 'u';
+        seq[2] = '0';
+        seq[3] = '0';
+        seq[4] = json_hex[c >> 4];
+        seq[5] = json_hex[c & 15];
+        ubuf_append_mem(out, seq, 6);
+        return;
+    }
+    ubuf_append_mem(out, seq, 2);
+}
+
+void json_append_escaped(UBuffer *out, const char *s, int len) {
+    const unsigned char *p = (const unsigned char *)s;
+    int i = 0;
+    ubuf_reserve(out, len);
+    while (i < len) {
+        int run = json_clean_run(p + i, len - i);
+        ubuf_append_mem(out, s + i, run);
+        i += run;
+        if (i < len) {
+            json_append_escape(out, p[i]);
+            i++;
+        }
+    }
+}
+
+void json_append_string(UBuffer *out, const char *s) {
+    ubuf_append_char(out, '"');
+    if (s) json_append_escaped(out, s, u_strlen(s));
+    ubuf_append_char(out, '"');
+}
+
+void json_append_result(UBuffer *out, const CommandResult *res, const char *cwd) {
+    int i;
+    ubuf_append_str(out, res->status == 0 ? "{\"ok\":true" : "{\"ok\":false");
+    ubuf_append_str(out, ",\"stdout\":");
+    if (res->stdout_text && res->stdout_len >= 0) {
+        ubuf_append_char(out, '"');
+        json_append_escaped(out, res->stdout_text, res->stdout_len);
+        ubuf_append_char(out, '"');
+    } else {
+        json_append_string(out, res->stdout_text);
+    }
+    ubuf_append_str(out, ",\"stderr\":");
+    json_append_string(out, res->stderr_text);
+    if (res->streamed) ubuf_append_str(out, ",\"streamed\":true");
+    if (!cwd) {
+        ubuf_append_char(out, '}');
+        return;
+    }
+    ubuf_append_str(out, ",\"cwd\":");
+    json_append_string(out, cwd);
+    ubuf_append_str(out, ",\"suggestions\":[");
+    for (i = 0; i < res->suggestion_count; i++) {
+        if (i > 0) ubuf_append_char(out, ',');
+        json_append_string(out, res->suggestions[i]);
+    }
+    ubuf_append_str(out, "]}");
+}
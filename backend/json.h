@@ -0,0 +1,15 @@
+#ifndef JSON_H
+#define JSON_H
+
+#include "utils.h"
+#include "commands.h"
+
+/* Append s[0..len) with JSON string escaping (no surrounding quotes) */
+void json_append_escaped(UBuffer *out, const char *s, int len);
+/* Append a quoted JSON string; a null pointer encodes as "" */
+void json_append_string(UBuffer *out, const char *s);
+/* Append a result object. With cwd == 0 only ok/stdout/stderr are
+   written (the per-command form used inside batch replies). */
+void json_append_result(UBuffer *out, const CommandResult *res, const char *cwd);
+
+#endif
@@ -1,5 +1,6 @@
 #include "logger.h"
 #include "utils.h"
+#include "arena.h"
 
 void log_init(LogQueue *q, int capacity) {
     int i;
@@ -38,13 +39,25 @@ int log_get_all(LogQueue *q, LogEntry **out, int *count) {
         *count = 0;
         return 0;
     }
-    *out = (LogEntry *)u_malloc(sizeof(LogEntry) * q->size);
+    *out = (LogEntry *)req_alloc(sizeof(LogEntry) * q->size);
     for (i = 0; i < q->size; i++) {
         int idx = (q->head + i) % q->capacity;
-        (*out)[i].timestamp = u_strdup(q->entries[idx].timestamp);
-        (*out)[i].message = u_strdup(q->entries[idx].message);
+        (*out)[i].timestamp = req_strdup(q->entries[idx].timestamp);
+        (*out)[i].message = req_strdup(q->entries[idx].message);
     }
     *count = q->size;
     return 0;
 }
 
+void log_free(LogQueue *q) {
+    int i;
+    for (i = 0; i < q->capacity; i++) {
+        if (q->entries[i].timestamp) u_free(q->entries[i].timestamp);
+        if (q->entries[i].message) u_free(q->entries[i].message);
+    }
+    if (q->entries) u_free(q->entries);
+    q->entries = 0;
+    q->size = 0;
+    q->capacity = 0;
+    q->head = 0;
+}
@@ -16,7 +16,9 @@ typedef struct {
 
 void log_init(LogQueue *q, int capacity);
 void log_add(LogQueue *q, const char *msg);
+/* Oldest first, copied into the request arena (see arena.h) */
 int log_get_all(LogQueue *q, LogEntry **out, int *count);
+void log_free(LogQueue *q);
 
 #endif
 
@@ -1,106 +1,88 @@
 #include <stdio.h>
-#include "filesystem.h"
-#include "history.h"
-#include "parser.h"
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#define read _read
+#define write _write
+#else
+#include <unistd.h>
+#endif
 #include "commands.h"
+#include "protocol.h"
+#include "server.h"
+#include "session.h"
 #include "utils.h"
-#include "logger.h"
 
-static void json_escape_and_print(const char *s) {
-    int i = 0;
-    char c;
-    putchar('"');
-    if (s) {
-        while ((c = s[i]) != 0) {
-            if (c == '"' || c == '\\') {
-                putchar('\\');
-                putchar(c);
-            } else if (c == '\n') {
-                putchar('\\');
-                putchar('n');
-            } else {
-                putchar(c);
-            }
-            i++;
-        }
+static int write_all(int fd, const char *data, int len) {
+    while (len > 0) {
+        int n = (int)write(fd, data, len);
+        if (n <= 0) return -1;
+        data += n;
+        len -= n;
     }
-    putchar('"');
+    return 0;
 }
 
-static void write_json_response(CommandResult *res, const char *cwd) {
-    int i;
-    printf("{");
-    printf("\"ok\":%s,", res->status == 0 ? "true" : "false");
-    printf("\"stdout\":");
-    json_escape_and_print(res->stdout_text ? res->stdout_text : "");
-    printf(",");
-    printf("\"stderr\":");
-    json_escape_and_print(res->stderr_text ? res->stderr_text : "");
-    printf(",");
-    printf("\"cwd\":");
-    json_escape_and_print(cwd ? cwd : "/");
-    printf(",");
-    printf("\"suggestions\":[");
-    for (i = 0; i < res->suggestion_count; i++) {
-        if (i > 0) printf(",");
-        json_escape_and_print(res->suggestions[i]);
-    }
-    printf("]}");
-    printf("\n");
-    fflush(stdout);
+/* Streamed output is pushed to stdout as soon as each chunk is framed */
+static void stdout_flush(ProtoOut *out) {
+    if (out->buf.length > 0) write_all(1, out->buf.data, out->buf.length);
+    out->buf.length = 0;
 }
 
-int main(void) {
-    char line[512];
-    int len;
+int main(int argc, char **argv) {
+    FrameReader reader;
+    ProtoOut out;
+    const char *listen_addr = 0;
+    int framed = 0;
+    int done = 0;
+    int i;
+
+    for (i = 1; i < argc; i++) {
+        if (u_strcmp(argv[i], "--framed") == 0) framed = 1;
+        if (u_strcmp(argv[i], "--timing") == 0) protocol_set_timing(1);
+        if (u_strcmp(argv[i], "--listen") == 0 && i + 1 < argc) listen_addr = argv[++i];
+    }
+#ifdef _WIN32
+    _setmode(0, _O_BINARY);
+    _setmode(1, _O_BINARY);
+#endif
 
-    fs_init();
-    history_init(100);
     commands_init();
+    session_table_init();
+    if (listen_addr) return server_run(listen_addr);
 
-    while (1) {
-        int ch;
-        len = 0;
-        while (1) {
-            ch = getchar();
-            if (ch == EOF) return 0;
-            if (ch == '\n') break;
-            if (len < 511) {
-                line[len++] = (char)ch;
-            }
-        }
-        line[len] = 0;
-        if (len == 0) {
-            continue;
-        }
-        if (u_strcmp(line, "exit") == 0) {
-            break;
-        }
-        history_add(line);
+    frame_reader_init(&reader, framed);
+    ubuf_init(&out.buf);
+    out.framed = framed;
+    out.session = 0;
+    out.request = 0;
+    out.flush = stdout_flush;
+    out.user = 0;
+
+    while (!done) {
+        Frame f;
+        int avail;
+        int n;
+        char *space = frame_reader_space(&reader, 65536, &avail);
+        n = (int)read(0, space, avail);
+        if (n <= 0) break;
+        frame_reader_commit(&reader, n);
 
-        {
-            TokenArray tokens;
-            CommandResult res;
-            char *cwd;
-            parser_init(&tokens);
-            parser_tokenize(line, &tokens);
-            res = cmd_execute(&tokens);
-            cwd = fs_pwd();
-            write_json_response(&res, cwd);
-            if (cwd) u_free(cwd);
-            if (res.stdout_text) u_free(res.stdout_text);
-            if (res.stderr_text) u_free(res.stderr_text);
-            if (res.suggestions) {
-                int i;
-                for (i = 0; i < res.suggestion_count; i++) {
-                    if (res.suggestions[i]) u_free(res.suggestions[i]);
-                }
-                u_free(res.suggestions);
+        /* answer everything that arrived, then flush it in one write */
+        out.buf.length = 0;
+        while (!done) {
+            int rc = frame_reader_next(&reader, &f);
+            if (rc < 0) {
+                done = 1;
+                break;
             }
-            parser_free(&tokens);
+            if (rc == 0) break;
+            done = protocol_handle(&f, &out);
         }
+        if (out.buf.length > 0 && write_all(1, out.buf.data, out.buf.length) != 0) break;
     }
 
+    ubuf_free(&out.buf);
+    frame_reader_free(&reader);
     return 0;
 }
-
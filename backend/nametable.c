@@ -0,0 +1,77 @@
+#include "nametable.h"
+#include "utils.h"
+
+static Name **buckets = 0;
+static int bucket_count = 0;
+static int name_count = 0;
+
+unsigned int name_hash(const char *s) {
+    unsigned int h = 2166136261u;
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void name_grow() {
+    int newcount = bucket_count ? bucket_count * 2 : 1024;
+    Name **nb = (Name **)u_malloc(sizeof(Name *) * newcount);
+    int i;
+    for (i = 0; i < newcount; i++) nb[i] = 0;
+    for (i = 0; i < bucket_count; i++) {
+        Name *n = buckets[i];
+        while (n) {
+            Name *next = n->next;
+            int idx = (int)(n->hash & (unsigned int)(newcount - 1));
+            n->next = nb[idx];
+            nb[idx] = n;
+            n = next;
+        }
+    }
+    if (buckets) u_free(buckets);
+    buckets = nb;
+    bucket_count = newcount;
+}
+
+Name *name_find(const char *s, unsigned int hash) {
+    Name *n;
+    if (!buckets) return 0;
+    n = buckets[hash & (unsigned int)(bucket_count - 1)];
+    while (n) {
+        if (n->hash == hash && u_strcmp(n->str, s) == 0) return n;
+        n = n->next;
+    }
+    return 0;
+}
+
+Name *name_intern(const char *s) {
+    unsigned int h = name_hash(s);
+    Name *n = name_find(s, h);
+    int idx;
+    if (n) {
+        n->refs++;
+        return n;
+    }
+    if (name_count >= bucket_count) name_grow();
+    n = (Name *)u_malloc(sizeof(Name) + u_strlen(s));
+    n->hash = h;
+    n->refs = 1;
+    n->len = u_strlen(s);
+    u_memcpy(n->str, s, n->len + 1);
+    idx = (int)(h & (unsigned int)(bucket_count - 1));
+    n->next = buckets[idx];
+    buckets[idx] = n;
+    name_count++;
+    return n;
+}
+
+void name_release(Name *n) {
+    Name **p;
+    if (--n->refs > 0) return;
+    p = &buckets[n->hash & (unsigned int)(bucket_count - 1)];
+    while (*p != n) p = &(*p)->next;
+    *p = n->next;
+    name_count--;
+    u_free(n);
+}
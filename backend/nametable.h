@@ -0,0 +1,27 @@
+#ifndef NAMETABLE_H
+#define NAMETABLE_H
+
+/*
+ * Interned filesystem names. Each distinct name is stored once, with its
+ * hash, and shared by every node that carries it, so two interned names
+ * are equal exactly when their pointers are. Records are refcounted:
+ * name_intern takes a reference and name_release drops it.
+ */
+
+typedef struct Name {
+    struct Name *next;   /* hash chain */
+    unsigned int hash;
+    int refs;
+    int len;
+    char str[1];         /* len bytes plus the NUL */
+} Name;
+
+/* FNV-1a, the hash every Name carries */
+unsigned int name_hash(const char *s);
+Name *name_intern(const char *s);
+/* The record for s if some node already uses that name, else 0;
+   hash must be name_hash(s). Takes no reference. */
+Name *name_find(const char *s, unsigned int hash);
+void name_release(Name *n);
+
+#endif
@@ -1,81 +1,171 @@
 #include "parser.h"
 #include "utils.h"
 
+/* An arena grown past this by one huge line is not kept for the next */
+#define PARSER_ARENA_KEEP 65536
+
 void parser_init(TokenArray *t) {
     t->items = 0;
+    t->lens = 0;
+    t->kinds = 0;
     t->count = 0;
     t->capacity = 0;
+    t->arena = 0;
+    t->arena_capacity = 0;
 }
 
 void parser_free(TokenArray *t) {
-    int i;
-    for (i = 0; i < t->count; i++) {
-        if (t->items[i]) u_free(t->items[i]);
+    t->count = 0;
+    if (t->arena_capacity > PARSER_ARENA_KEEP) {
+        u_free(t->arena);
+        t->arena = 0;
+        t->arena_capacity = 0;
     }
+}
+
+void parser_destroy(TokenArray *t) {
     if (t->items) u_free(t->items);
-    t->items = 0;
-    t->count = 0;
-    t->capacity = 0;
+    if (t->lens) u_free(t->lens);
+    if (t->kinds) u_free(t->kinds);
+    if (t->arena) u_free(t->arena);
+    parser_init(t);
 }
 
-static void parser_add_token(TokenArray *t, const char *buf, int len) {
-    char *s;
-    int i;
-    if (len <= 0) return;
-    if (t->capacity == 0) {
-        t->capacity = 4;
-        t->items = (char **)u_malloc(sizeof(char *) * t->capacity);
-    } else if (t->count >= t->capacity) {
-        int newcap = t->capacity * 2;
+static void parser_add_token(TokenArray *t, char *s, int len, int kind) {
+    if (t->count >= t->capacity) {
+        int newcap = t->capacity ? t->capacity * 2 : 8;
         char **ni = (char **)u_malloc(sizeof(char *) * newcap);
-        for (i = 0; i < t->count; i++) {
-            ni[i] = t->items[i];
-        }
-        u_free(t->items);
+        int *nl = (int *)u_malloc(sizeof(int) * newcap);
+        int *nk = (int *)u_malloc(sizeof(int) * newcap);
+        u_memcpy(ni, t->items, sizeof(char *) * t->count);
+        u_memcpy(nl, t->lens, sizeof(int) * t->count);
+        u_memcpy(nk, t->kinds, sizeof(int) * t->count);
+        if (t->items) u_free(t->items);
+        if (t->lens) u_free(t->lens);
+        if (t->kinds) u_free(t->kinds);
         t->items = ni;
+        t->lens = nl;
+        t->kinds = nk;
         t->capacity = newcap;
     }
-    s = (char *)u_malloc(len + 1);
-    for (i = 0; i < len; i++) {
-        s[i] = buf[i];
+    t->items[t->count] = s;
+    t->lens[t->count] = len;
+    t->kinds[t->count] = kind;
+    t->count++;
+}
+
+/* Make room for `extra` more bytes at w, moving the arena (and the
+   tokens already in it) if it has to grow */
+static char *parser_reserve(TokenArray *t, char *w, char **start, int extra) {
+    int used = (int)(w - t->arena);
+    char *old = t->arena;
+    char *na;
+    int newcap;
+    int k;
+    if (used + extra <= t->arena_capacity) return w;
+    newcap = t->arena_capacity * 2;
+    while (newcap < used + extra) newcap *= 2;
+    na = (char *)u_malloc(newcap);
+    u_memcpy(na, old, used);
+    for (k = 0; k < t->count; k++) {
+        if (t->kinds[k] == TOK_WORD) t->items[k] = na + (t->items[k] - old);
+    }
+    *start = na + (*start - old);
+    u_free(old);
+    t->arena = na;
+    t->arena_capacity = newcap;
+    return na + used;
+}
+
+static int is_name_char(char c, int first) {
+    if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_') return 1;
+    return !first && c >= '0' && c <= '9';
+}
+
+/* Variable reference after a '$' at line[p]: NAME or {NAME}. Sets the
+   name's position and length and the index just past the reference;
+   returns 0 if there is none (the '$' is then literal). */
+static int parser_var_ref(const char *line, int p, int n, int *name, int *len, int *next) {
+    int braced = p < n && line[p] == '{';
+    int q;
+    if (braced) p++;
+    q = p;
+    while (q < n && is_name_char(line[q], q == p)) q++;
+    if (q == p) return 0;
+    if (braced) {
+        if (q >= n || line[q] != '}') return 0;
+        *next = q + 1;
+    } else {
+        *next = q;
     }
-    s[len] = 0;
-    t->items[t->count++] = s;
+    *name = p;
+    *len = q - p;
+    return 1;
 }
 
 void parser_tokenize(const char *line, TokenArray *t) {
-    int i = 0;
-    char buf[512];
-    int bi = 0;
+    parser_tokenize_env(line, t, 0);
+}
+
+/*
+ * Unescaping never makes text longer, and every token but the last is
+ * followed by a separator that produces no output, so a line of n bytes
+ * always fits in n + 1 bytes of arena, terminators included. Operator
+ * tokens point at string literals and take no arena space. Only a
+ * variable's value can exceed that, and the arena grows for it.
+ */
+void parser_tokenize_env(const char *line, TokenArray *t, HashMap *vars) {
+    int n = u_strlen(line);
     int in_quotes = 0;
-    int escape = 0;
-    char c;
-    while (1) {
-        c = line[i];
-        if (c == 0) {
-            if (bi > 0) {
-                parser_add_token(t, buf, bi);
-            }
-            break;
-        }
-        if (escape) {
-            buf[bi++] = c;
-            escape = 0;
-        } else if (c == '\\') {
-            escape = 1;
+    int i;
+    int name, name_len, next;
+    char *w;
+    char *start;
+
+    t->count = 0;
+    if (t->arena_capacity < n + 1) {
+        if (t->arena) u_free(t->arena);
+        t->arena_capacity = n + 1 > 256 ? n + 1 : 256;
+        t->arena = (char *)u_malloc(t->arena_capacity);
+    }
+    w = start = t->arena;
+    for (i = 0; i < n; i++) {
+        char c = line[i];
+        if (c == '\\') {
+            /* a trailing backslash escapes nothing and is dropped */
+            if (i + 1 < n) *w++ = line[++i];
         } else if (c == '"') {
             in_quotes = !in_quotes;
-        } else if (!in_quotes && (c == ' ' || c == '\t')) {
-            if (bi > 0) {
-                parser_add_token(t, buf, bi);
-                bi = 0;
+        } else if (c == '$' && vars && parser_var_ref(line, i + 1, n, &name, &name_len, &next)) {
+            /* copied straight from the map; the value is not re-scanned */
+            const char *v = hm_get_n(vars, line + name, name_len);
+            if (v) {
+                int vn = u_strlen(v);
+                w = parser_reserve(t, w, &start, vn + (n - next) + 1);
+                u_memcpy(w, v, vn);
+                w += vn;
             }
-        } else {
-            if (bi < 511) {
-                buf[bi++] = c;
+            i = next - 1;
+        } else if (!in_quotes && (c == ' ' || c == '\t' || c == '|' || c == '>')) {
+            if (w > start) {
+                *w = 0;
+                parser_add_token(t, start, (int)(w - start), TOK_WORD);
+                start = ++w;
+            }
+            if (c == '|') {
+                parser_add_token(t, (char *)"|", 1, TOK_PIPE);
+            } else if (c == '>' && i + 1 < n && line[i + 1] == '>') {
+                parser_add_token(t, (char *)">>", 2, TOK_APPEND);
+                i++;
+            } else if (c == '>') {
+                parser_add_token(t, (char *)">", 1, TOK_WRITE);
             }
+        } else {
+            *w++ = c;
         }
-        i++;
+    }
+    if (w > start) {
+        *w = 0;
+        parser_add_token(t, start, (int)(w - start), TOK_WORD);
     }
 }
-
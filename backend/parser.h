@@ -1,15 +1,46 @@
 #ifndef PARSER_H
 #define PARSER_H
 
+#include "hashmap.h"
+
+/*
+ * Tokens are views into one arena owned by the TokenArray: the line is
+ * unescaped into it token by token, each token NUL-terminated in place.
+ * The arena and item arrays are kept between lines, so tokenizing does
+ * no per-token allocation and has no length limit.
+ *
+ * Unquoted, unescaped `|`, `>` and `>>` are operators: they end the word
+ * before them and become tokens of their own, marked in kinds[].
+ *
+ * With a variable map, `$NAME` and `${NAME}` are replaced by the value
+ * during the same pass (unset names expand to nothing), inside quotes
+ * too; `\$` keeps a literal '$'. Values are inserted as-is: they never
+ * split words or form operators.
+ */
+#define TOK_WORD 0
+#define TOK_PIPE 1    /* | */
+#define TOK_WRITE 2   /* > */
+#define TOK_APPEND 3  /* >> */
+
 typedef struct {
-    char **items;
+    char **items;   /* items[i] points into arena, NUL-terminated */
+    int *lens;      /* byte length of items[i] */
+    int *kinds;     /* TOK_WORD or an operator */
     int count;
     int capacity;
+    char *arena;
+    int arena_capacity;
 } TokenArray;
 
+/* A zero-filled TokenArray (e.g. a static one) is already initialized */
 void parser_init(TokenArray *t);
+/* Drop the tokens but keep the storage for the next line */
 void parser_free(TokenArray *t);
+/* Release all storage */
+void parser_destroy(TokenArray *t);
+/* Replace the contents of t with the tokens of line */
 void parser_tokenize(const char *line, TokenArray *t);
+/* The same, expanding $NAME / ${NAME} from vars (0: no expansion) */
+void parser_tokenize_env(const char *line, TokenArray *t, HashMap *vars);
 
 #endif
-
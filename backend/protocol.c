@@ -0,0 +1,353 @@
+#include "protocol.h"
+#include "arena.h"
+#include "filesystem.h"
+#include "history.h"
+#include "parser.h"
+#include "commands.h"
+#include "json.h"
+#include "session.h"
+#include "stats.h"
+#include "utils.h"
+
+#define FRAME_READ_INITIAL 4096
+
+static int protocol_timing = 0;
+
+void protocol_set_timing(int on) {
+    protocol_timing = on;
+}
+
+static unsigned int get_u32(const unsigned char *p) {
+    return ((unsigned int)p[0] << 24) | ((unsigned int)p[1] << 16) |
+           ((unsigned int)p[2] << 8) | (unsigned int)p[3];
+}
+
+static void put_u32(char *p, unsigned int v) {
+    p[0] = (char)((v >> 24) & 0xff);
+    p[1] = (char)((v >> 16) & 0xff);
+    p[2] = (char)((v >> 8) & 0xff);
+    p[3] = (char)(v & 0xff);
+}
+
+void frame_reader_init(FrameReader *r, int framed) {
+    r->capacity = FRAME_READ_INITIAL;
+    r->data = (char *)u_malloc(r->capacity);
+    r->start = 0;
+    r->length = 0;
+    r->scan = 0;
+    r->need = 0;
+    r->framed = framed;
+    r->held_pos = -1;
+    r->held = 0;
+}
+
+void frame_reader_free(FrameReader *r) {
+    if (r->data) u_free(r->data);
+    r->data = 0;
+    r->start = 0;
+    r->length = 0;
+    r->capacity = 0;
+}
+
+/* Put back the byte a previous frame's terminator replaced */
+static void frame_reader_release(FrameReader *r) {
+    if (r->held_pos >= 0) {
+        r->data[r->held_pos] = r->held;
+        r->held_pos = -1;
+    }
+}
+
+char *frame_reader_space(FrameReader *r, int want, int *avail) {
+    int used;
+    frame_reader_release(r);
+    if (r->need > want) want = r->need;
+    if (r->start > 0) {
+        used = r->length - r->start;
+        u_memmove(r->data, r->data + r->start, used);
+        r->scan -= r->start;
+        if (r->scan < 0) r->scan = 0;
+        r->length = used;
+        r->start = 0;
+    }
+    /* drop back to the initial size once a large frame has been consumed */
+    if (r->length == 0 && r->capacity > FRAME_READ_INITIAL && want < FRAME_READ_INITIAL) {
+        u_free(r->data);
+        r->capacity = FRAME_READ_INITIAL;
+        r->data = (char *)u_malloc(r->capacity);
+        r->scan = 0;
+    }
+    /* keep one spare byte so a payload can always be NUL-terminated */
+    if (r->capacity - r->length - 1 < want) {
+        int newcap = r->capacity;
+        char *nd;
+        /* need and length stay below FRAME_MAX_PAYLOAD plus a read, so
+           this stops long before newcap could overflow */
+        while (newcap - r->length - 1 < want) newcap *= 2;
+        nd = (char *)u_malloc(newcap);
+        u_memcpy(nd, r->data, r->length);
+        u_free(r->data);
+        r->data = nd;
+        r->capacity = newcap;
+    }
+    *avail = r->capacity - r->length - 1;
+    return r->data + r->length;
+}
+
+void frame_reader_commit(FrameReader *r, int n) {
+    if (n > 0) r->length += n;
+}
+
+static int frame_reader_next_line(FrameReader *r, Frame *out) {
+    int i = r->scan > r->start ? r->scan : r->start;
+    while (i < r->length) {
+        if (r->data[i] == '\n') {
+            r->data[i] = 0;
+            out->kind = FRAME_CMD;
+            out->session = 0;
+            out->request = 0;
+            out->payload = r->data + r->start;
+            out->length = i - r->start;
+            r->start = i + 1;
+            r->scan = r->start;
+            return 1;
+        }
+        i++;
+    }
+    r->scan = r->length;
+    if (r->length - r->start > FRAME_MAX_PAYLOAD) return -1;
+    return 0;
+}
+
+int frame_reader_next(FrameReader *r, Frame *out) {
+    const unsigned char *h;
+    unsigned int len;
+    int end;
+    frame_reader_release(r);
+    if (!r->framed) return frame_reader_next_line(r, out);
+    if (r->length - r->start < FRAME_HEADER_SIZE) {
+        r->need = FRAME_HEADER_SIZE - (r->length - r->start);
+        return 0;
+    }
+    h = (const unsigned char *)(r->data + r->start);
+    len = get_u32(h);
+    if (len > FRAME_MAX_PAYLOAD) return -1;
+    if (r->length - r->start < FRAME_HEADER_SIZE + (int)len) {
+        r->need = FRAME_HEADER_SIZE + (int)len - (r->length - r->start);
+        return 0;
+    }
+    r->need = 0;
+    end = r->start + FRAME_HEADER_SIZE + (int)len;
+    out->kind = (char)h[4];
+    out->session = get_u32(h + 5);
+    out->request = get_u32(h + 9);
+    out->payload = r->data + r->start + FRAME_HEADER_SIZE;
+    out->length = (int)len;
+    /* capacity always exceeds length, so data[end] is addressable */
+    r->held = r->data[end];
+    r->held_pos = end;
+    r->data[end] = 0;
+    r->start = end;
+    return 1;
+}
+
+int frame_begin(UBuffer *out, char kind, unsigned int session, unsigned int request) {
+    int start = out->length;
+    char header[FRAME_HEADER_SIZE];
+    put_u32(header, 0);
+    header[4] = kind;
+    put_u32(header + 5, session);
+    put_u32(header + 9, request);
+    ubuf_append_mem(out, header, FRAME_HEADER_SIZE);
+    return start;
+}
+
+void frame_end(UBuffer *out, int start) {
+    put_u32(out->data + start, (unsigned int)(out->length - start - FRAME_HEADER_SIZE));
+}
+
+/* Serialize a result; for a real command (`name` set) also time the
+   serialization, record the run and, with --timing, report the phases */
+static void protocol_append_result(UBuffer *b, const CommandResult *res, const char *cwd,
+                                   const char *name, StatsSample *sample) {
+    unsigned long long t0 = stats_now();
+    json_append_result(b, res, cwd);
+    if (!name) return;
+    sample->json_ns = stats_now() - t0;
+    stats_record(name, sample);
+    if (protocol_timing) {
+        /* reopen the object json_append_result just closed */
+        b->length--;
+        ubuf_append_char(b, ',');
+        stats_append_timing(b, sample);
+        ubuf_append_char(b, '}');
+    }
+}
+
+static void protocol_reply(ProtoOut *out, CommandResult *res, const char *name, StatsSample *sample) {
+    const char *cwd = session_active() ? fs_pwd() : "/";
+    int start = 0;
+    if (out->framed) start = frame_begin(&out->buf, FRAME_RESULT, out->session, out->request);
+    protocol_append_result(&out->buf, res, cwd, name, sample);
+    if (out->framed) {
+        frame_end(&out->buf, start);
+    } else {
+        ubuf_append_char(&out->buf, '\n');
+    }
+}
+
+static void protocol_reply_error(ProtoOut *out, const char *msg) {
+    CommandResult res;
+    res.status = 1;
+    res.stdout_text = 0;
+    res.stdout_len = -1;
+    res.stderr_text = (char *)msg;
+    res.suggestions = 0;
+    res.suggestion_count = 0;
+    res.streamed = 0;
+    protocol_reply(out, &res, 0, 0);
+}
+
+/* Output sink for FRAME_STREAM requests: each chunk leaves as its own
+   FRAME_OUTPUT frame, already escaped, and is flushed right away */
+static void protocol_stream_chunk(const char *data, int len, void *user) {
+    ProtoOut *out = (ProtoOut *)user;
+    int start = frame_begin(&out->buf, FRAME_OUTPUT, out->session, out->request);
+    json_append_escaped(&out->buf, data, len);
+    frame_end(&out->buf, start);
+    if (out->flush) out->flush(out);
+}
+
+/* Record, tokenize and execute one command line, timing both phases.
+   *name is set to the registry's name for the command, or 0 if unknown. */
+static CommandResult protocol_run_line(const char *line, const char **name, StatsSample *sample) {
+    /* reused for every line so its storage is allocated once */
+    static TokenArray tokens;
+    CommandResult res;
+    unsigned long long t0, t1;
+    history_add(line);
+    t0 = stats_now();
+    parser_tokenize_env(line, &tokens, commands_vars());
+    t1 = stats_now();
+    res = cmd_execute(&tokens);
+    sample->exec_ns = stats_now() - t1;
+    sample->parse_ns = t1 - t0;
+    sample->json_ns = 0;
+    *name = 0;
+    if (tokens.count > 0) {
+        const CommandSpec *spec = commands_lookup(tokens.items[0]);
+        if (spec) *name = spec->name;
+    }
+    parser_free(&tokens);
+    return res;
+}
+
+/* Run every line of a batch back-to-back and answer with one object:
+   {"results":[{"ok","stdout","stderr"},...],"ok":all_ok,"cwd":final}.
+   Returns 1 if the batch ended with `exit`. */
+static int protocol_handle_batch(char *payload, int length, ProtoOut *out) {
+    UBuffer *b = &out->buf;
+    int start = frame_begin(b, FRAME_RESULT, out->session, out->request);
+    int all_ok = 1;
+    int first = 1;
+    int exiting = 0;
+    int i = 0;
+    char *cwd;
+
+    ubuf_append_str(b, "{\"results\":[");
+    while (i < length) {
+        char *line = payload + i;
+        int j = i;
+        while (j < length && payload[j] != '\n') j++;
+        payload[j] = 0;
+        i = j + 1;
+        if (line[0] == 0) continue;
+        if (u_strcmp(line, "exit") == 0) {
+            exiting = 1;
+            break;
+        }
+        {
+            const char *name;
+            StatsSample sample;
+            CommandResult res = protocol_run_line(line, &name, &sample);
+            if (res.status != 0) all_ok = 0;
+            if (!first) ubuf_append_char(b, ',');
+            first = 0;
+            protocol_append_result(b, &res, 0, name, &sample);
+        }
+        /* the line's result is serialized; its temporaries can go */
+        req_reset();
+    }
+    ubuf_append_str(b, "],\"ok\":");
+    ubuf_append_str(b, all_ok ? "true" : "false");
+    ubuf_append_str(b, ",\"cwd\":");
+    cwd = fs_pwd();
+    json_append_string(b, cwd);
+    ubuf_append_char(b, '}');
+    frame_end(b, start);
+    return exiting;
+}
+
+static void protocol_reply_ok(ProtoOut *out) {
+    CommandResult res;
+    res.status = 0;
+    res.stdout_text = 0;
+    res.stdout_len = -1;
+    res.stderr_text = 0;
+    res.suggestions = 0;
+    res.suggestion_count = 0;
+    res.streamed = 0;
+    protocol_reply(out, &res, 0, 0);
+}
+
+static int protocol_dispatch(const Frame *f, ProtoOut *out) {
+    CommandResult res;
+    const char *name;
+    StatsSample sample;
+    int stream = 0;
+
+    out->session = f->session;
+    out->request = f->request;
+    if (out->framed && f->kind == FRAME_CLOSE) {
+        session_close(out->user, f->session);
+        /* answer with no session bound, so the reply's cwd is "/" */
+        session_activate(0);
+        protocol_reply_ok(out);
+        return 0;
+    }
+    session_activate(session_get(out->user, f->session));
+    if (out->framed && f->kind == FRAME_BATCH) {
+        if (protocol_handle_batch(f->payload, f->length, out)) {
+            session_close(out->user, f->session);
+        }
+        return 0;
+    }
+    if (out->framed && f->kind == FRAME_STREAM) {
+        stream = 1;
+    } else if (f->kind != FRAME_CMD) {
+        protocol_reply_error(out, "protocol: unknown request kind");
+        return 0;
+    }
+    if (f->length == 0) {
+        /* line mode skips blank lines; a framed client still needs a reply */
+        if (out->framed) protocol_reply_error(out, "empty command");
+        return 0;
+    }
+    if (u_strcmp(f->payload, "exit") == 0) {
+        if (!out->framed) return 1;
+        protocol_reply_ok(out);
+        session_close(out->user, f->session);
+        return 0;
+    }
+    if (stream) commands_set_sink(protocol_stream_chunk, out);
+    res = protocol_run_line(f->payload, &name, &sample);
+    commands_set_sink(0, 0);
+    protocol_reply(out, &res, name, &sample);
+    return 0;
+}
+
+int protocol_handle(const Frame *f, ProtoOut *out) {
+    int rc = protocol_dispatch(f, out);
+    /* everything the request allocated is done with once the reply is out */
+    req_reset();
+    return rc;
+}
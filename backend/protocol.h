@@ -0,0 +1,90 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include "utils.h"
+
+/*
+ * Wire protocol between the backend and its client.
+ *
+ * Line mode (default): one command per '\n'-terminated line in,
+ * one JSON object per line out.
+ *
+ * Framed mode (--framed): every message in both directions is
+ *   [4-byte big-endian payload length][1-byte kind]
+ *   [4-byte big-endian session id][4-byte big-endian request id][payload]
+ * so payloads need no escaping and replies need no scanning. Each
+ * session id names an independent terminal. Replies echo both ids, so
+ * a client can match them to requests without relying on order.
+ */
+
+#define FRAME_HEADER_SIZE 13
+/* Larger requests (or, in line mode, longer lines) drop the connection,
+   so one peer can't make the reader allocate without bound */
+#define FRAME_MAX_PAYLOAD (64 * 1024 * 1024)
+
+/* Request kinds */
+#define FRAME_CMD 'C'      /* payload: one command line */
+#define FRAME_BATCH 'B'    /* payload: '\n'-separated command lines */
+#define FRAME_STREAM 'S'   /* payload: one command line, output may stream */
+#define FRAME_CLOSE 'X'    /* payload ignored: discard the session */
+
+/* Response kinds */
+#define FRAME_RESULT 'R'   /* payload: JSON result object */
+#define FRAME_OUTPUT 'O'   /* payload: JSON-escaped slice of a streamed stdout */
+
+typedef struct {
+    char kind;
+    unsigned int session;
+    unsigned int request;  /* opaque to the backend, echoed in replies */
+    char *payload;         /* NUL-terminated until the next read */
+    int length;
+} Frame;
+
+/* Growable input buffer that frames or lines are cut out of */
+typedef struct {
+    char *data;
+    int start;             /* first unconsumed byte */
+    int length;            /* end of valid data */
+    int capacity;
+    int scan;              /* line mode: bytes already searched for '\n' */
+    int need;              /* framed mode: bytes missing from current frame */
+    int framed;
+    int held_pos;          /* byte overwritten by a payload terminator */
+    char held;
+} FrameReader;
+
+void frame_reader_init(FrameReader *r, int framed);
+void frame_reader_free(FrameReader *r);
+/* Space to read at least `want` more bytes into; returns its size */
+char *frame_reader_space(FrameReader *r, int want, int *avail);
+void frame_reader_commit(FrameReader *r, int n);
+/* 1 if a complete frame (or line) was cut out, 0 if more input is needed,
+   -1 on a malformed frame header or one over FRAME_MAX_PAYLOAD */
+int frame_reader_next(FrameReader *r, Frame *out);
+
+/* Start a framed message in `out`; returns the header offset */
+int frame_begin(UBuffer *out, char kind, unsigned int session, unsigned int request);
+/* Patch the length of the message started at `start` */
+void frame_end(UBuffer *out, int start);
+
+/* Where replies are assembled before they reach the client */
+typedef struct ProtoOut {
+    UBuffer buf;
+    int framed;
+    unsigned int session;  /* session of the request being answered */
+    unsigned int request;  /* its request id */
+    /* optional: deliver buf to the client mid-request and empty it */
+    void (*flush)(struct ProtoOut *out);
+    /* passed to flush; also owns the sessions this output's requests use */
+    void *user;
+} ProtoOut;
+
+/* Run one request in its session and append the reply (frames, or a JSON
+   line in line mode) to out->buf. Returns 1 if the client asked the
+   backend to exit (line mode only; framed `exit` ends just the session).
+   The request arena (arena.h) is reset before it returns. */
+int protocol_handle(const Frame *f, ProtoOut *out);
+/* With --timing, every command result also carries a "timing" object */
+void protocol_set_timing(int on);
+
+#endif
@@ -0,0 +1,185 @@
+#include "script.h"
+#include "arena.h"
+#include "utils.h"
+
+#define SCRIPT_CACHE_SIZE 16
+
+/* most recently used first */
+static Script *cache[SCRIPT_CACHE_SIZE];
+static int cache_count = 0;
+
+static void script_free(Script *s) {
+    if (s->arena) u_free(s->arena);
+    if (s->items) u_free(s->items);
+    if (s->lens) u_free(s->lens);
+    if (s->kinds) u_free(s->kinds);
+    if (s->lines) u_free(s->lines);
+    u_free(s);
+}
+
+/* Take s out of use; a script still running is freed by script_release */
+static void script_drop(Script *s) {
+    if (s->running) {
+        s->stale = 1;
+    } else {
+        script_free(s);
+    }
+}
+
+static void script_add_token(Script *s, int *cap, int count, char *item, int len, int kind) {
+    if (count >= *cap) {
+        int newcap = *cap ? *cap * 2 : 64;
+        char **ni = (char **)u_malloc(sizeof(char *) * newcap);
+        int *nl = (int *)u_malloc(sizeof(int) * newcap);
+        int *nk = (int *)u_malloc(sizeof(int) * newcap);
+        u_memcpy(ni, s->items, sizeof(char *) * count);
+        u_memcpy(nl, s->lens, sizeof(int) * count);
+        u_memcpy(nk, s->kinds, sizeof(int) * count);
+        if (s->items) u_free(s->items);
+        if (s->lens) u_free(s->lens);
+        if (s->kinds) u_free(s->kinds);
+        s->items = ni;
+        s->lens = nl;
+        s->kinds = nk;
+        *cap = newcap;
+    }
+    s->items[count] = item;
+    s->lens[count] = len;
+    s->kinds[count] = kind;
+}
+
+static void script_add_line(Script *s, int *cap, int line_no, int first, int count,
+                            const char *text) {
+    if (s->line_count >= *cap) {
+        int newcap = *cap ? *cap * 2 : 32;
+        ScriptLine *nl = (ScriptLine *)u_malloc(sizeof(ScriptLine) * newcap);
+        u_memcpy(nl, s->lines, sizeof(ScriptLine) * s->line_count);
+        if (s->lines) u_free(s->lines);
+        s->lines = nl;
+        *cap = newcap;
+    }
+    s->lines[s->line_count].line_no = line_no;
+    s->lines[s->line_count].first = first;
+    s->lines[s->line_count].count = count;
+    s->lines[s->line_count].text = text;
+    s->line_count++;
+}
+
+/*
+ * A line's words need at most its length plus one byte (see
+ * parser_tokenize), so the arena is sized once from the file: content
+ * plus one byte per line; a line kept as text takes the same. Operator
+ * tokens keep pointing at the parser's string literals.
+ */
+static Script *script_compile(const TreeNode *f) {
+    static TokenArray tokens;
+    Script *s = (Script *)u_malloc(sizeof(Script));
+    char *c = (char *)req_alloc(f->u.file.size + 1);
+    int size = f->u.file.size;
+    int newlines = 0;
+    int token_cap = 0;
+    int line_cap = 0;
+    int token_count = 0;
+    int used = 0;
+    int line_no = 0;
+    int start = 0;
+    int i;
+    UBuffer line;
+
+    /* tokenizing wants each line contiguous, so work from a flat copy */
+    content_read(&f->u.file, 0, size, c);
+    c[size] = 0;
+    for (i = 0; i < size; i++) {
+        if (c[i] == '\n') newlines++;
+    }
+    s->node = f;
+    s->version = f->version;
+    s->modified_at = f->modified_at;
+    s->arena = (char *)u_malloc(size + newlines + 2);
+    s->items = 0;
+    s->lens = 0;
+    s->kinds = 0;
+    s->lines = 0;
+    s->line_count = 0;
+    s->running = 0;
+    s->stale = 0;
+
+    ubuf_init_temp(&line);
+    for (i = 0; i <= size; i++) {
+        int j;
+        int k;
+        if (i < size && c[i] != '\n') continue;
+        line_no++;
+        j = start;
+        start = i + 1;
+        while (j < i && (c[j] == ' ' || c[j] == '\t' || c[j] == '\r')) j++;
+        if (j == i || c[j] == '#') continue;
+        line.length = 0;
+        ubuf_append_mem(&line, c + j, i - j);
+        if (line.length > 0 && line.data[line.length - 1] == '\r') {
+            line.data[--line.length] = 0;
+        }
+        if (u_find_char(line.data, '$') >= 0) {
+            char *text = s->arena + used;
+            u_memcpy(text, line.data, line.length + 1);
+            used += line.length + 1;
+            script_add_line(s, &line_cap, line_no, token_count, 0, text);
+            continue;
+        }
+        parser_tokenize(line.data, &tokens);
+        if (tokens.count == 0) continue;
+        script_add_line(s, &line_cap, line_no, token_count, tokens.count, 0);
+        for (k = 0; k < tokens.count; k++) {
+            char *item = tokens.items[k];
+            if (tokens.kinds[k] == TOK_WORD) {
+                item = s->arena + used;
+                u_memcpy(item, tokens.items[k], tokens.lens[k] + 1);
+                used += tokens.lens[k] + 1;
+            }
+            script_add_token(s, &token_cap, token_count++, item, tokens.lens[k], tokens.kinds[k]);
+        }
+    }
+    parser_free(&tokens);
+    return s;
+}
+
+Script *script_acquire(const TreeNode *f) {
+    Script *s = 0;
+    int i;
+    for (i = 0; i < cache_count; i++) {
+        if (cache[i]->node != f) continue;
+        s = cache[i];
+        cache_count--;
+        for (; i < cache_count; i++) cache[i] = cache[i + 1];
+        if (s->version != f->version || s->modified_at != f->modified_at) {
+            script_drop(s);
+            s = 0;
+        }
+        break;
+    }
+    if (!s) {
+        s = script_compile(f);
+        if (cache_count == SCRIPT_CACHE_SIZE) {
+            script_drop(cache[--cache_count]);
+        }
+    }
+    for (i = cache_count; i > 0; i--) cache[i] = cache[i - 1];
+    cache[0] = s;
+    cache_count++;
+    s->running++;
+    return s;
+}
+
+void script_release(Script *s) {
+    s->running--;
+    if (s->stale && s->running == 0) script_free(s);
+}
+
+void script_line_tokens(const Script *s, int i, TokenArray *out) {
+    const ScriptLine *l = &s->lines[i];
+    parser_init(out);
+    out->items = s->items + l->first;
+    out->lens = s->lens + l->first;
+    out->kinds = s->kinds + l->first;
+    out->count = l->count;
+}
@@ -0,0 +1,48 @@
+#ifndef SCRIPT_H
+#define SCRIPT_H
+
+#include "filesystem.h"
+#include "parser.h"
+
+/*
+ * Compiled form of a script file for `source`: every non-blank line that
+ * is not a `#` comment, tokenized once. All tokens share one arena and
+ * one set of item arrays, the same layout a TokenArray uses, so a line
+ * runs from a view of them with no re-tokenizing.
+ */
+
+typedef struct {
+    int line_no;  /* 1-based line in the file, for error messages */
+    int first;    /* index of its first token */
+    int count;
+    /* a line that uses $NAME is kept as text instead, to be tokenized
+       when it runs so it sees the variables as they are then */
+    const char *text;
+} ScriptLine;
+
+typedef struct {
+    /* cache key; node is only compared, never dereferenced */
+    const TreeNode *node;
+    unsigned long long version;
+    unsigned long long modified_at;
+
+    char *arena;
+    char **items;
+    int *lens;
+    int *kinds;
+    ScriptLine *lines;
+    int line_count;
+
+    int running;  /* nested `source` calls executing it */
+    int stale;    /* replaced in the cache; freed once it stops running */
+} Script;
+
+/* Compiled program for file f, built on first use and reused while f's
+   content is unchanged. Pair with script_release when done running it. */
+Script *script_acquire(const TreeNode *f);
+void script_release(Script *s);
+/* Tokens of line i as a TokenArray (a view; nothing to free), for a
+   line without text */
+void script_line_tokens(const Script *s, int i, TokenArray *out);
+
+#endif
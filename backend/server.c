@@ -0,0 +1,317 @@
+#include <stdio.h>
+#include "server.h"
+
+#ifdef __linux__
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "protocol.h"
+#include "session.h"
+#include "utils.h"
+
+#define SERVER_BACKLOG 128
+#define SERVER_MAX_EVENTS 64
+/* Room asked of the frame reader per recv; a frame still arriving grows
+   it to just what that frame needs */
+#define SERVER_READ_MIN 512
+/* Stop reading from a client while more than this waits to be sent */
+#define SERVER_OUT_HIGH (4 * 1024 * 1024)
+/* An output buffer grown past this is freed once it drains */
+#define SERVER_OUT_KEEP 65536
+/* How long a streaming command waits for a stalled client */
+#define SERVER_STALL_MS 10000
+
+/*
+ * One client connection. Replies are appended to out.buf; out_pos is
+ * how much of it the socket has already taken. Whatever is left waits
+ * for EPOLLOUT instead of blocking the loop; past SERVER_OUT_HIGH the
+ * connection is not read until the client catches up, and a command
+ * streaming to it waits in conn_flush instead of queueing more. The
+ * connection owns the sessions its frames open (out.user is the owner),
+ * so ids are private to it and its sessions are closed with it.
+ */
+typedef struct Conn {
+    int fd;
+    int out_pos;
+    int dead;              /* the peer went away mid-request */
+    unsigned int events;   /* what epoll is watching for */
+    FrameReader reader;
+    ProtoOut out;
+} Conn;
+
+static int server_epfd = -1;
+
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/* Push pending output; returns -1 if the peer is gone */
+static int conn_send(Conn *c) {
+    UBuffer *b = &c->out.buf;
+    while (c->out_pos < b->length) {
+        ssize_t n = send(c->fd, b->data + c->out_pos, b->length - c->out_pos, MSG_NOSIGNAL);
+        if (n > 0) {
+            c->out_pos += (int)n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        return -1;
+    }
+    if (c->out_pos == b->length) {
+        if (b->capacity > SERVER_OUT_KEEP) {
+            ubuf_free(b);
+            ubuf_init(b);
+        }
+        b->length = 0;
+        c->out_pos = 0;
+    }
+    return 0;
+}
+
+static int conn_pending(const Conn *c) {
+    return c->out.buf.length - c->out_pos;
+}
+
+/* ProtoOut flush hook: streamed chunks go out as soon as they are framed.
+   A command cannot be suspended mid-stream, so once SERVER_OUT_HIGH is
+   queued it waits here for the client to drain; a client that stalls
+   past SERVER_STALL_MS is dropped and the rest of the output discarded. */
+static void conn_flush(ProtoOut *out) {
+    Conn *c = (Conn *)out->user;
+    if (!c->dead && conn_send(c) != 0) c->dead = 1;
+    while (!c->dead && conn_pending(c) >= SERVER_OUT_HIGH) {
+        struct pollfd pfd;
+        int rc;
+        pfd.fd = c->fd;
+        pfd.events = POLLOUT;
+        pfd.revents = 0;
+        rc = poll(&pfd, 1, SERVER_STALL_MS);
+        if (rc < 0 && errno == EINTR) continue;
+        if (rc <= 0 || conn_send(c) != 0) c->dead = 1;
+    }
+    if (c->dead) {
+        out->buf.length = 0;
+        c->out_pos = 0;
+    }
+}
+
+/* Watch for output room while replies are queued, and for input unless
+   too much of it is queued */
+static int conn_watch(Conn *c) {
+    struct epoll_event ev;
+    unsigned int events = 0;
+    if (conn_pending(c) < SERVER_OUT_HIGH) events |= EPOLLIN;
+    if (conn_pending(c) > 0) events |= EPOLLOUT;
+    if (c->events == events) return 0;
+    ev.events = events;
+    ev.data.ptr = c;
+    if (epoll_ctl(server_epfd, EPOLL_CTL_MOD, c->fd, &ev) != 0) return -1;
+    c->events = events;
+    return 0;
+}
+
+static void conn_close(Conn *c) {
+    epoll_ctl(server_epfd, EPOLL_CTL_DEL, c->fd, 0);
+    close(c->fd);
+    session_close_owner(c);
+    frame_reader_free(&c->reader);
+    ubuf_free(&c->out.buf);
+    u_free(c);
+}
+
+static void conn_open(int fd) {
+    struct epoll_event ev;
+    Conn *c;
+    if (set_nonblocking(fd) != 0) {
+        close(fd);
+        return;
+    }
+    c = (Conn *)u_malloc(sizeof(Conn));
+    c->fd = fd;
+    c->out_pos = 0;
+    c->dead = 0;
+    c->events = EPOLLIN;
+    frame_reader_init(&c->reader, 1);
+    ubuf_init(&c->out.buf);
+    c->out.framed = 1;
+    c->out.session = 0;
+    c->out.request = 0;
+    c->out.flush = conn_flush;
+    c->out.user = c;
+    ev.events = EPOLLIN;
+    ev.data.ptr = c;
+    if (epoll_ctl(server_epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+        close(fd);
+        frame_reader_free(&c->reader);
+        ubuf_free(&c->out.buf);
+        u_free(c);
+    }
+}
+
+/* Read what is available and answer every complete frame.
+   Returns -1 when the connection should be dropped. */
+static int conn_readable(Conn *c) {
+    while (conn_pending(c) < SERVER_OUT_HIGH) {
+        Frame f;
+        int avail;
+        int rc;
+        char *space = frame_reader_space(&c->reader, SERVER_READ_MIN, &avail);
+        ssize_t n = recv(c->fd, space, avail, 0);
+        if (n == 0) return -1;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return -1;
+        }
+        frame_reader_commit(&c->reader, (int)n);
+        while ((rc = frame_reader_next(&c->reader, &f)) > 0) {
+            protocol_handle(&f, &c->out);
+            if (c->dead) return -1;
+        }
+        if (rc < 0) return -1;
+        if (n < avail) break;
+    }
+    return 0;
+}
+
+static void conn_event(Conn *c, unsigned int events) {
+    if (events & (EPOLLERR | EPOLLHUP)) {
+        if (!(events & EPOLLIN)) {
+            conn_close(c);
+            return;
+        }
+    }
+    if ((events & EPOLLIN) && conn_readable(c) != 0) {
+        conn_close(c);
+        return;
+    }
+    if (conn_send(c) != 0 || conn_watch(c) != 0) {
+        conn_close(c);
+    }
+}
+
+/* Port, host:port or unix socket path (anything containing '/') */
+static int server_listen(const char *addr) {
+    int fd;
+    int i;
+    int slash = 0;
+    for (i = 0; addr[i]; i++) {
+        if (addr[i] == '/') slash = 1;
+    }
+    if (slash) {
+        struct sockaddr_un sun;
+        int len = u_strlen(addr);
+        if (len >= (int)sizeof(sun.sun_path)) {
+            fprintf(stderr, "listen: socket path too long\n");
+            return -1;
+        }
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) return -1;
+        sun.sun_family = AF_UNIX;
+        u_memcpy(sun.sun_path, addr, len + 1);
+        unlink(addr);
+        if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) != 0) {
+            close(fd);
+            return -1;
+        }
+    } else {
+        struct sockaddr_in sin;
+        char host[64];
+        const char *port = addr;
+        int one = 1;
+        int colon = -1;
+        for (i = 0; addr[i]; i++) {
+            if (addr[i] == ':') colon = i;
+        }
+        u_strcpy(host, "127.0.0.1");
+        if (colon >= 0) {
+            if (colon >= (int)sizeof(host)) return -1;
+            u_memcpy(host, addr, colon);
+            host[colon] = 0;
+            port = addr + colon + 1;
+        }
+        sin.sin_family = AF_INET;
+        sin.sin_port = htons((unsigned short)u_atoi(port));
+        if (inet_pton(AF_INET, host, &sin.sin_addr) != 1) {
+            fprintf(stderr, "listen: bad address %s\n", host);
+            return -1;
+        }
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0) return -1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(fd, (struct sockaddr *)&sin, sizeof(sin)) != 0) {
+            close(fd);
+            return -1;
+        }
+    }
+    if (listen(fd, SERVER_BACKLOG) != 0 || set_nonblocking(fd) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int server_run(const char *addr) {
+    struct epoll_event ev;
+    struct epoll_event events[SERVER_MAX_EVENTS];
+    int lfd;
+
+    signal(SIGPIPE, SIG_IGN);
+    lfd = server_listen(addr);
+    if (lfd < 0) {
+        perror("listen");
+        return 1;
+    }
+    server_epfd = epoll_create1(0);
+    if (server_epfd < 0) {
+        perror("epoll_create1");
+        close(lfd);
+        return 1;
+    }
+    /* the listener is the only registration whose data is not a Conn */
+    ev.events = EPOLLIN;
+    ev.data.ptr = 0;
+    epoll_ctl(server_epfd, EPOLL_CTL_ADD, lfd, &ev);
+
+    for (;;) {
+        int n = epoll_wait(server_epfd, events, SERVER_MAX_EVENTS, -1);
+        int i;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            break;
+        }
+        for (i = 0; i < n; i++) {
+            if (events[i].data.ptr == 0) {
+                int cfd;
+                while ((cfd = accept(lfd, 0, 0)) >= 0) conn_open(cfd);
+            } else {
+                conn_event((Conn *)events[i].data.ptr, events[i].events);
+            }
+        }
+    }
+    close(server_epfd);
+    close(lfd);
+    return 1;
+}
+
+#else
+
+int server_run(const char *addr) {
+    (void)addr;
+    fprintf(stderr, "--listen is only supported on Linux\n");
+    return 1;
+}
+
+#endif
@@ -0,0 +1,12 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+/*
+ * Socket server mode (--listen <addr>): a single-threaded, non-blocking
+ * epoll loop that speaks the framed protocol to many clients at once.
+ * `addr` is a unix socket path (anything containing '/'), a TCP port,
+ * or host:port. Linux only; returns nonzero if the server cannot start.
+ */
+int server_run(const char *addr);
+
+#endif
@@ -0,0 +1,143 @@
+#include <stdint.h>
+#include "session.h"
+#include "utils.h"
+
+#define SESSION_HISTORY_MAX 100
+
+static Session **buckets = 0;
+static int bucket_count = 0;
+static int session_total = 0;
+static Session *active = 0;
+
+static unsigned int session_hash(const void *owner, unsigned int id) {
+    id ^= (unsigned int)((uintptr_t)owner >> 4) * 2654435761u;
+    id ^= id >> 16;
+    id *= 0x45d9f3bu;
+    id ^= id >> 16;
+    return id;
+}
+
+static void session_table_alloc(int count) {
+    int i;
+    buckets = (Session **)u_malloc(sizeof(Session *) * count);
+    for (i = 0; i < count; i++) buckets[i] = 0;
+    bucket_count = count;
+}
+
+void session_table_init() {
+    session_table_alloc(64);
+    session_total = 0;
+}
+
+/* Double the table once it holds more sessions than buckets */
+static void session_table_grow() {
+    Session **old = buckets;
+    int old_count = bucket_count;
+    int i;
+    session_table_alloc(old_count * 2);
+    for (i = 0; i < old_count; i++) {
+        Session *s = old[i];
+        while (s) {
+            Session *next = s->next;
+            int idx = (int)(session_hash(s->owner, s->id) % (unsigned int)bucket_count);
+            s->next = buckets[idx];
+            buckets[idx] = s;
+            s = next;
+        }
+    }
+    u_free(old);
+}
+
+static Session *session_create(const void *owner, unsigned int id) {
+    Session *s = (Session *)u_malloc(sizeof(Session));
+    s->owner = owner;
+    s->id = id;
+    s->next = 0;
+    /* build the new state while it is bound, then restore the caller's */
+    fs_bind(&s->fs);
+    fs_init();
+    history_bind(&s->hist);
+    history_init(SESSION_HISTORY_MAX);
+    commands_state_init(&s->cmd);
+    if (active) {
+        session_activate(active);
+    }
+    return s;
+}
+
+Session *session_get(const void *owner, unsigned int id) {
+    int idx = (int)(session_hash(owner, id) % (unsigned int)bucket_count);
+    Session *s = buckets[idx];
+    while (s) {
+        if (s->owner == owner && s->id == id) return s;
+        s = s->next;
+    }
+    s = session_create(owner, id);
+    s->next = buckets[idx];
+    buckets[idx] = s;
+    session_total++;
+    if (session_total > bucket_count) session_table_grow();
+    return s;
+}
+
+void session_activate(Session *s) {
+    active = s;
+    fs_bind(s ? &s->fs : 0);
+    history_bind(s ? &s->hist : 0);
+    commands_bind(s ? &s->cmd : 0);
+}
+
+Session *session_active() {
+    return active;
+}
+
+/* Free a session already unlinked from its chain */
+static void session_destroy(Session *s) {
+    session_total--;
+    fs_bind(&s->fs);
+    fs_clear();
+    history_bind(&s->hist);
+    history_clear();
+    commands_state_free(&s->cmd);
+    session_activate(active == s ? 0 : active);
+    u_free(s);
+}
+
+int session_close(const void *owner, unsigned int id) {
+    int idx = (int)(session_hash(owner, id) % (unsigned int)bucket_count);
+    Session *s = buckets[idx];
+    Session *prev = 0;
+    while (s) {
+        if (s->owner == owner && s->id == id) break;
+        prev = s;
+        s = s->next;
+    }
+    if (!s) return -1;
+    if (prev) prev->next = s->next;
+    else buckets[idx] = s->next;
+    session_destroy(s);
+    return 0;
+}
+
+int session_close_owner(const void *owner) {
+    int closed = 0;
+    int i;
+    for (i = 0; i < bucket_count; i++) {
+        Session **link = &buckets[i];
+        while (*link) {
+            Session *s = *link;
+            if (s->owner == owner) {
+                *link = s->next;
+                session_destroy(s);
+                closed++;
+            } else {
+                link = &s->next;
+            }
+        }
+    }
+    return closed;
+}
+
+int session_count() {
+    return session_total;
+}
@@ -0,0 +1,34 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include "filesystem.h"
+#include "history.h"
+#include "commands.h"
+
+/* One independent terminal: its own filesystem, history, undo/redo,
+   variables and log. Code and the command trie are shared. Sessions are
+   keyed by (owner, id): each socket client is its own owner, so two
+   clients using the same id never see each other's state. */
+typedef struct Session {
+    const void *owner;
+    unsigned int id;
+    FsState fs;
+    HistoryState hist;
+    CommandState cmd;
+    struct Session *next;  /* hash chain */
+} Session;
+
+void session_table_init();
+/* Look up a session, creating it on first use */
+Session *session_get(const void *owner, unsigned int id);
+/* Bind the session's state into every module; 0 unbinds them */
+void session_activate(Session *s);
+/* The bound session, or 0 if none is */
+Session *session_active();
+/* Free a session; returns -1 if it does not exist */
+int session_close(const void *owner, unsigned int id);
+/* Free every session an owner created; returns how many */
+int session_close_owner(const void *owner);
+int session_count();
+
+#endif
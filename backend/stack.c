@@ -39,6 +39,8 @@ void stack_clear(OpStack *s) {
         if (s->items[i].path) u_free(s->items[i].path);
         if (s->items[i].old_content) u_free(s->items[i].old_content);
         if (s->items[i].new_content) u_free(s->items[i].new_content);
+        content_free(&s->items[i].old_file);
+        content_free(&s->items[i].new_file);
     }
     if (s->items) u_free(s->items);
     s->items = 0;
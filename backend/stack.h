@@ -1,6 +1,8 @@
 #ifndef STACK_H
 #define STACK_H
 
+#include "content.h"
+
 typedef enum {
     OP_CREATE_FILE,
     OP_DELETE_FILE,
@@ -14,8 +16,10 @@ typedef enum {
 typedef struct {
     OperationType type;
     char *path;
-    char *old_content;
+    char *old_content;   /* names, for OP_MOVE and OP_RENAME */
     char *new_content;
+    Content old_file;    /* shared snapshots, for OP_WRITE_FILE and OP_DELETE_FILE */
+    Content new_file;
 } Operation;
 
 typedef struct {
@@ -0,0 +1,223 @@
+#include "stats.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#define STATS_SUB_BITS 3
+#define STATS_SUB (1 << STATS_SUB_BITS)
+/* values are clamped below 2^40 ns (about 18 minutes) */
+#define STATS_MAX_BITS 40
+#define STATS_BUCKETS ((STATS_MAX_BITS - STATS_SUB_BITS + 1) * STATS_SUB)
+
+enum { PHASE_PARSE, PHASE_EXEC, PHASE_JSON, PHASE_TOTAL, PHASE_COUNT };
+
+static const char *phase_names[PHASE_COUNT] = { "parse", "exec", "json", "total" };
+
+typedef struct {
+    unsigned int counts[STATS_BUCKETS];
+    unsigned long long count;
+    unsigned long long max;
+} StatsHist;
+
+typedef struct {
+    const char *name;
+    StatsHist phase[PHASE_COUNT];
+} StatsEntry;
+
+static StatsEntry **entries = 0;
+static int entry_count = 0;
+static int entry_capacity = 0;
+
+unsigned long long stats_now() {
+#ifdef _WIN32
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER now;
+    if (freq.QuadPart == 0) QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (unsigned long long)(now.QuadPart / freq.QuadPart) * 1000000000ULL +
+           (unsigned long long)(now.QuadPart % freq.QuadPart) * 1000000000ULL /
+               (unsigned long long)freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + (unsigned long long)ts.tv_nsec;
+#endif
+}
+
+static int bucket_of(unsigned long long v) {
+    int top = 0;
+    int shift;
+    if (v >= (1ULL << STATS_MAX_BITS)) v = (1ULL << STATS_MAX_BITS) - 1;
+    if (v < STATS_SUB) return (int)v;
+    while ((v >> top) > 1) top++;
+    shift = top - STATS_SUB_BITS;
+    return (shift + 1) * STATS_SUB + (int)((v >> shift) - STATS_SUB);
+}
+
+/* Highest value that lands in bucket i */
+static unsigned long long bucket_top(int i) {
+    int shift;
+    if (i < STATS_SUB) return (unsigned long long)i;
+    shift = i / STATS_SUB - 1;
+    return (((unsigned long long)(STATS_SUB + i % STATS_SUB) + 1) << shift) - 1;
+}
+
+static void hist_add(StatsHist *h, unsigned long long v) {
+    h->counts[bucket_of(v)]++;
+    h->count++;
+    if (v > h->max) h->max = v;
+}
+
+static unsigned long long hist_percentile(const StatsHist *h, int pct) {
+    unsigned long long want = (h->count * (unsigned long long)pct + 99) / 100;
+    unsigned long long seen = 0;
+    int i;
+    if (want == 0) want = 1;
+    for (i = 0; i < STATS_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= want) {
+            unsigned long long top = bucket_top(i);
+            return top < h->max ? top : h->max;
+        }
+    }
+    return h->max;
+}
+
+static StatsEntry *find_entry(const char *name) {
+    int i;
+    for (i = 0; i < entry_count; i++) {
+        if (entries[i]->name == name || u_strcmp(entries[i]->name, name) == 0) return entries[i];
+    }
+    return 0;
+}
+
+static StatsEntry *get_entry(const char *name) {
+    StatsEntry *e = find_entry(name);
+    char *p;
+    int i;
+    if (e) return e;
+    if (entry_count == entry_capacity) {
+        int newcap = entry_capacity ? entry_capacity * 2 : 16;
+        StatsEntry **ne = (StatsEntry **)u_malloc(sizeof(StatsEntry *) * newcap);
+        for (i = 0; i < entry_count; i++) ne[i] = entries[i];
+        if (entries) u_free(entries);
+        entries = ne;
+        entry_capacity = newcap;
+    }
+    e = (StatsEntry *)u_malloc(sizeof(StatsEntry));
+    p = (char *)e;
+    for (i = 0; i < (int)sizeof(StatsEntry); i++) p[i] = 0;
+    e->name = name;
+    entries[entry_count++] = e;
+    return e;
+}
+
+void stats_record(const char *name, const StatsSample *s) {
+    StatsEntry *e = get_entry(name);
+    hist_add(&e->phase[PHASE_PARSE], s->parse_ns);
+    hist_add(&e->phase[PHASE_EXEC], s->exec_ns);
+    hist_add(&e->phase[PHASE_JSON], s->json_ns);
+    hist_add(&e->phase[PHASE_TOTAL], s->parse_ns + s->exec_ns + s->json_ns);
+}
+
+void stats_reset() {
+    int i;
+    for (i = 0; i < entry_count; i++) u_free(entries[i]);
+    entry_count = 0;
+}
+
+static void u64_to_str(unsigned long long v, char *out) {
+    char tmp[24];
+    int n = 0;
+    int i;
+    do {
+        tmp[n++] = (char)('0' + v % 10);
+        v /= 10;
+    } while (v > 0);
+    for (i = 0; i < n; i++) out[i] = tmp[n - 1 - i];
+    out[n] = 0;
+}
+
+/* 850ns, 12.3us, 4.5ms, 1.2s */
+static void format_ns(unsigned long long v, char *out) {
+    const char *unit;
+    unsigned long long scale;
+    int n;
+    if (v < 1000) {
+        u64_to_str(v, out);
+        u_strcat(out, "ns");
+        return;
+    }
+    if (v < 1000000ULL) {
+        scale = 1000ULL;
+        unit = "us";
+    } else if (v < 1000000000ULL) {
+        scale = 1000000ULL;
+        unit = "ms";
+    } else {
+        scale = 1000000000ULL;
+        unit = "s";
+    }
+    u64_to_str(v / scale, out);
+    n = u_strlen(out);
+    out[n] = '.';
+    out[n + 1] = (char)('0' + (v % scale) * 10 / scale);
+    out[n + 2] = 0;
+    u_strcat(out, unit);
+}
+
+static void append_padded(UBuffer *b, const char *s, int width, int right) {
+    int n = u_strlen(s);
+    if (!right) ubuf_append_str(b, s);
+    while (n++ < width) ubuf_append_char(b, ' ');
+    if (right) ubuf_append_str(b, s);
+}
+
+static void append_row(UBuffer *b, const char *label, const StatsHist *h) {
+    static const int pcts[3] = { 50, 95, 99 };
+    char num[32];
+    int i;
+    append_padded(b, label, 14, 0);
+    u64_to_str(h->count, num);
+    append_padded(b, num, 8, 1);
+    for (i = 0; i < 3; i++) {
+        format_ns(hist_percentile(h, pcts[i]), num);
+        append_padded(b, num, 10, 1);
+    }
+    format_ns(h->max, num);
+    append_padded(b, num, 10, 1);
+    ubuf_append_char(b, '\n');
+}
+
+int stats_report(UBuffer *b, const char *name) {
+    int i;
+    if (name) {
+        StatsEntry *e = find_entry(name);
+        if (!e) return -1;
+        ubuf_append_str(b, "phase            count       p50       p95       p99       max\n");
+        for (i = 0; i < PHASE_COUNT; i++) append_row(b, phase_names[i], &e->phase[i]);
+        return 0;
+    }
+    ubuf_append_str(b, "command          count       p50       p95       p99       max\n");
+    for (i = 0; i < entry_count; i++) {
+        append_row(b, entries[i]->name, &entries[i]->phase[PHASE_TOTAL]);
+    }
+    return 0;
+}
+
+void stats_append_timing(UBuffer *b, const StatsSample *s) {
+    char num[24];
+    ubuf_append_str(b, "\"timing\":{\"parse_ns\":");
+    u64_to_str(s->parse_ns, num);
+    ubuf_append_str(b, num);
+    ubuf_append_str(b, ",\"exec_ns\":");
+    u64_to_str(s->exec_ns, num);
+    ubuf_append_str(b, num);
+    ubuf_append_str(b, ",\"json_ns\":");
+    u64_to_str(s->json_ns, num);
+    ubuf_append_str(b, num);
+    ubuf_append_char(b, '}');
+}
@@ -0,0 +1,31 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include "utils.h"
+
+/*
+ * Per-command latency statistics. Each command name owns one histogram
+ * per phase (parse, execute, serialize, and their total). Buckets are
+ * log-linear like HDR histograms: 8 sub-buckets per power of two, so any
+ * recorded value is reported within 12.5%.
+ */
+
+typedef struct {
+    unsigned long long parse_ns;
+    unsigned long long exec_ns;
+    unsigned long long json_ns;
+} StatsSample;
+
+/* Monotonic clock in nanoseconds */
+unsigned long long stats_now();
+/* Account one run of the command `name` (a string that outlives the
+   process, e.g. a literal from the command table) */
+void stats_record(const char *name, const StatsSample *s);
+/* Append a table of count/p50/p95/p99/max: one row per command, or one
+   row per phase when `name` is given. Returns -1 if `name` has no data. */
+int stats_report(UBuffer *b, const char *name);
+void stats_reset();
+/* Append "timing":{"parse_ns":..,"exec_ns":..,"json_ns":..} */
+void stats_append_timing(UBuffer *b, const StatsSample *s);
+
+#endif
@@ -1,5 +1,6 @@
 #include "trie.h"
 #include "utils.h"
+#include "arena.h"
 
 TrieNode *trie_create() {
     int i;
@@ -28,24 +29,13 @@ static void trie_collect_rec(TrieNode *node, char *buf, int depth,
     int i;
     if (!node) return;
     if (node->is_end) {
-        int len = depth;
-        char *s;
-        int j;
-        if (*out_cap == 0) {
-            *out_cap = 4;
-            *out_words = (char **)u_malloc(sizeof(char *) * (*out_cap));
-        } else if (*out_count >= *out_cap) {
-            int newcap = (*out_cap) * 2;
-            char **nw = (char **)u_malloc(sizeof(char *) * newcap);
-            for (j = 0; j < *out_count; j++) nw[j] = (*out_words)[j];
-            u_free(*out_words);
-            *out_words = nw;
+        if (*out_count >= *out_cap) {
+            int newcap = *out_cap ? (*out_cap) * 2 : 4;
+            *out_words = (char **)req_realloc(*out_words, (int)sizeof(char *) * (*out_cap),
+                                              (int)sizeof(char *) * newcap);
             *out_cap = newcap;
         }
-        s = (char *)u_malloc(len + 1);
-        for (i = 0; i < len; i++) s[i] = buf[i];
-        s[len] = 0;
-        (*out_words)[(*out_count)++] = s;
+        (*out_words)[(*out_count)++] = req_strndup(buf, depth);
     }
     for (i = 0; i < 256; i++) {
         if (node->children[i]) {
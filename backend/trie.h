@@ -8,6 +8,7 @@ typedef struct TrieNode {
 
 TrieNode *trie_create();
 void trie_insert(TrieNode *root, const char *word);
+/* Matching words, in the request arena (see arena.h) */
 int trie_complete(TrieNode *root, const char *prefix,
                   char ***out_words, int *out_count);
 
@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include "utils.h"
+#include "arena.h"
 
 void *u_malloc(int size) {
     void *p = malloc(size);
@@ -155,29 +156,60 @@ void ubuf_init(UBuffer *b) {
     b->length = 0;
     b->data = (char *)u_malloc(b->capacity);
     b->data[0] = 0;
+    b->temp = 0;
+}
+
+void ubuf_init_temp(UBuffer *b) {
+    b->capacity = 64;
+    b->length = 0;
+    b->data = (char *)req_alloc(b->capacity);
+    b->data[0] = 0;
+    b->temp = 1;
 }
 
 void ubuf_free(UBuffer *b) {
     if (b->data) {
-        u_free(b->data);
+        if (!b->temp) u_free(b->data);
         b->data = 0;
     }
     b->length = 0;
     b->capacity = 0;
 }
 
+void u_memcpy(void *dst, const void *src, int n) {
+    char *d = (char *)dst;
+    const char *s = (const char *)src;
+    int i;
+    for (i = 0; i < n; i++) {
+        d[i] = s[i];
+    }
+}
+
+void u_memmove(void *dst, const void *src, int n) {
+    char *d = (char *)dst;
+    const char *s = (const char *)src;
+    int i;
+    if (d < s) {
+        for (i = 0; i < n; i++) d[i] = s[i];
+    } else if (d > s) {
+        for (i = n - 1; i >= 0; i--) d[i] = s[i];
+    }
+}
+
 static void ubuf_grow(UBuffer *b, int extra) {
     int need = b->length + extra + 1;
     if (need <= b->capacity) return;
-    int newcap = b->capacity * 2;
-    int i;
+    int newcap = b->capacity > 0 ? b->capacity * 2 : 64;
     while (newcap < need) newcap *= 2;
-    char *nd = (char *)u_malloc(newcap);
-    for (i = 0; i < b->length; i++) {
-        nd[i] = b->data[i];
+    if (b->temp) {
+        b->data = (char *)req_realloc(b->data, b->length + 1, newcap);
+        b->capacity = newcap;
+        return;
     }
+    char *nd = (char *)u_malloc(newcap);
+    u_memcpy(nd, b->data, b->length);
     nd[b->length] = 0;
-    u_free(b->data);
+    if (b->data) u_free(b->data);
     b->data = nd;
     b->capacity = newcap;
 }
@@ -199,6 +231,18 @@ void ubuf_append_str(UBuffer *b, const char *s) {
     b->data[b->length] = 0;
 }
 
+void ubuf_reserve(UBuffer *b, int extra) {
+    ubuf_grow(b, extra);
+}
+
+void ubuf_append_mem(UBuffer *b, const char *s, int n) {
+    if (n <= 0) return;
+    ubuf_grow(b, n);
+    u_memcpy(b->data + b->length, s, n);
+    b->length += n;
+    b->data[b->length] = 0;
+}
+
 char *ubuf_to_string(UBuffer *b) {
     char *out = (char *)u_malloc(b->length + 1);
     int i;
@@ -289,6 +333,6 @@ char *u_get_extension(const char *filename) {
         return 0; /* No extension */
     }
     
-    return u_strdup(filename + last_dot + 1);
+    return req_strdup(filename + last_dot + 1);
 }
 
@@ -4,6 +4,9 @@
 /* Basic memory helpers */
 void *u_malloc(int size);
 void u_free(void *p);
+void u_memcpy(void *dst, const void *src, int n);
+/* Like u_memcpy, but the ranges may overlap */
+void u_memmove(void *dst, const void *src, int n);
 
 /* String helpers (no <string.h>) */
 int u_strlen(const char *s);
@@ -24,6 +27,7 @@ int u_levenshtein(const char *s1, const char *s2);
 
 /* File extension validation */
 int u_is_valid_extension(const char *ext);
+/* Extension after the last dot (request arena copy), or 0 */
 char *u_get_extension(const char *filename);
 
 /* Simple dynamic buffer for building strings */
@@ -31,12 +35,19 @@ typedef struct {
     char *data;
     int length;
     int capacity;
+    int temp;  /* storage comes from the request arena */
 } UBuffer;
 
 void ubuf_init(UBuffer *b);
+/* Buffer for request-lifetime text: grows inside the request arena, so it
+   needs no ubuf_free and its data may be handed to a CommandResult as is */
+void ubuf_init_temp(UBuffer *b);
 void ubuf_free(UBuffer *b);
 void ubuf_append_char(UBuffer *b, char c);
 void ubuf_append_str(UBuffer *b, const char *s);
+void ubuf_append_mem(UBuffer *b, const char *s, int n);
+/* Make room for `extra` more bytes without changing the contents */
+void ubuf_reserve(UBuffer *b, int extra);
 char *ubuf_to_string(UBuffer *b);
 
 #endif
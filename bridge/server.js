@@ -1,104 +1,502 @@
 const http = require("http");
+const crypto = require("crypto");
+const fs = require("fs");
 const { spawn } = require("child_process");
+const os = require("os");
 const path = require("path");
 
 const root = path.join(__dirname, "..");
 const bin = process.platform === "win32" ? path.join(root, "terminal.exe") : path.join(root, "terminal");
 
-let backendError = null;
-const child = spawn(bin, {
-  cwd: root,
-  stdio: ["pipe", "pipe", "inherit"],
-  windowsHide: true,
-});
+// Length-prefixed frames:
+// [u32 BE payload length][u8 kind][u32 BE session id][u32 BE request id][payload]
+const FRAME_HEADER = 13;
+const FRAME_CMD = 0x43; // 'C'
+const FRAME_BATCH = 0x42; // 'B'
+const FRAME_STREAM = 0x53; // 'S'
+const FRAME_RESULT = 0x52; // 'R'
+const FRAME_OUTPUT = 0x4f; // 'O': escaped stdout slice of a streamed reply
 
-let buffer = "";
-const pending = [];
+// CTERMINAL_TIMING=1 makes every result carry per-phase "timing".
+const BACKEND_ARGS = process.env.CTERMINAL_TIMING ? ["--framed", "--timing"] : ["--framed"];
 
-child.on("error", (err) => {
-  backendError = err;
-  while (pending.length) {
-    const p = pending.shift();
-    p.reject(err);
+// Bytes received but not yet consumed, kept as a list of chunks. Data is
+// copied only when a requested range spans several chunks, so consuming a
+// stream costs O(size) no matter how many pieces it arrives in.
+class ByteQueue {
+  constructor() {
+    this.chunks = [];
+    this.length = 0;
   }
-});
 
-child.stdout.on("data", (chunk) => {
-  buffer += chunk.toString("utf8");
-  let idx;
-  while ((idx = buffer.indexOf("\n")) >= 0) {
-    const line = buffer.slice(0, idx);
-    buffer = buffer.slice(idx + 1);
-    const req = pending.shift();
-    if (!req) continue;
-    try {
-      const json = JSON.parse(line);
-      req.resolve(json);
-    } catch (e) {
-      req.reject(e);
+  push(chunk) {
+    this.chunks.push(chunk);
+    this.length += chunk.length;
+  }
+
+  // The first n bytes as one Buffer (at least n long), without consuming them.
+  peek(n) {
+    if (this.chunks[0].length < n) {
+      this.chunks.unshift(this.take(n));
+      this.length += n;
     }
+    return this.chunks[0];
   }
-});
 
-child.on("exit", () => {
-  while (pending.length) {
-    const p = pending.shift();
-    p.reject(new Error("backend exited"));
+  // Remove and return the first n bytes (a view when one chunk holds them).
+  take(n) {
+    const head = this.chunks[0];
+    this.length -= n;
+    if (head.length >= n) {
+      if (head.length === n) this.chunks.shift();
+      else this.chunks[0] = head.subarray(n);
+      return head.subarray(0, n);
+    }
+    const parts = [];
+    let got = 0;
+    while (got < n) {
+      const c = this.chunks[0];
+      if (c.length <= n - got) {
+        parts.push(c);
+        got += c.length;
+        this.chunks.shift();
+      } else {
+        parts.push(c.subarray(0, n - got));
+        this.chunks[0] = c.subarray(n - got);
+        got = n;
+      }
+    }
+    return Buffer.concat(parts, n);
   }
-});
+}
 
-function sendCommand(cmd) {
-  return new Promise((resolve, reject) => {
-    if (backendError) return reject(backendError);
-    pending.push({ resolve, reject });
-    child.stdin.write(cmd + "\n");
-  });
+// Cuts backend frames out of the worker's stdout; each frame is copied out
+// at most once.
+class FrameParser {
+  constructor(onFrame) {
+    this.onFrame = onFrame;
+    this.queue = new ByteQueue();
+    this.need = FRAME_HEADER; // bytes required before the next step
+  }
+
+  push(chunk) {
+    const q = this.queue;
+    q.push(chunk);
+    while (q.length >= this.need) {
+      const total = FRAME_HEADER + q.peek(FRAME_HEADER).readUInt32BE(0);
+      if (q.length < total) {
+        this.need = total;
+        return;
+      }
+      const frame = q.take(total);
+      this.need = FRAME_HEADER;
+      this.onFrame(frame[4], frame.readUInt32BE(9), frame.subarray(FRAME_HEADER));
+    }
+  }
+}
+
+// Each worker is one backend process with its own sessions. Every request
+// carries an id the backend echoes, so replies are matched by id rather
+// than by arrival order and one bad reply cannot shift the others.
+class Worker {
+  constructor(slot) {
+    this.slot = slot;
+    this.pending = new Map();
+    this.nextRequest = 1;
+    this.sessions = 0;
+    this.error = null;
+    this.dead = false;
+    this.parser = new FrameParser((kind, id, payload) => this.onFrame(kind, id, payload));
+    this.child = spawn(bin, BACKEND_ARGS, {
+      cwd: root,
+      stdio: ["pipe", "pipe", "inherit"],
+      windowsHide: true,
+    });
+    this.child.on("error", (err) => this.fail(err));
+    this.child.on("exit", () => this.fail(new Error("backend exited")));
+    this.child.stdin.on("error", (err) => this.fail(err));
+    this.child.stdout.on("data", (chunk) => this.parser.push(chunk));
+  }
+
+  load() {
+    return this.sessions + this.pending.size;
+  }
+
+  onFrame(kind, id, payload) {
+    const req = this.pending.get(id);
+    if (!req) return;
+    if (kind === FRAME_OUTPUT) {
+      if (req.onChunk) req.onChunk(payload);
+      return;
+    }
+    if (kind !== FRAME_RESULT) return;
+    this.pending.delete(id);
+    req.resolve(payload);
+  }
+
+  // A crashed or unspawnable backend fails its in-flight requests, loses
+  // its sessions and is replaced in the same pool slot.
+  fail(err) {
+    if (this.dead) return;
+    this.dead = true;
+    this.error = err;
+    for (const req of this.pending.values()) req.reject(err);
+    this.pending.clear();
+    this.child.kill();
+    for (const [name, s] of sessionIds) {
+      if (s.worker === this) sessionIds.delete(name);
+    }
+    setTimeout(() => {
+      workers[this.slot] = new Worker(this.slot);
+    }, RESPAWN_DELAY_MS);
+  }
+
+  send(kind, session, text, onChunk) {
+    return new Promise((resolve, reject) => {
+      if (this.dead) return reject(this.error);
+      const id = this.nextRequest;
+      this.nextRequest = (this.nextRequest + 1) >>> 0 || 1;
+      this.pending.set(id, { resolve, reject, onChunk });
+      const payload = Buffer.from(text, "utf8");
+      const header = Buffer.alloc(FRAME_HEADER);
+      header.writeUInt32BE(payload.length, 0);
+      header[4] = kind;
+      header.writeUInt32BE(session, 5);
+      header.writeUInt32BE(id, 9);
+      this.child.stdin.write(Buffer.concat([header, payload]));
+    });
+  }
+}
+
+const POOL_SIZE = Math.max(1, parseInt(process.env.CTERMINAL_WORKERS, 10) || os.cpus().length);
+const RESPAWN_DELAY_MS = 500;
+const workers = [];
+for (let i = 0; i < POOL_SIZE; i++) workers.push(new Worker(i));
+
+// Client session names are pinned to a worker and a backend session id on
+// first use; the unnamed default session lives on worker 0 as id 0.
+const sessionIds = new Map();
+let nextSessionId = 1;
+
+function leastLoaded() {
+  let best = workers[0];
+  for (const w of workers) {
+    if (w.dead) continue;
+    if (best.dead || w.load() < best.load()) best = w;
+  }
+  return best;
+}
+
+function sessionFor(name) {
+  if (!name) return { worker: workers[0], id: 0 };
+  let s = sessionIds.get(name);
+  if (s === undefined) {
+    s = { worker: leastLoaded(), id: nextSessionId++ };
+    s.worker.sessions++;
+    sessionIds.set(name, s);
+  }
+  return s;
+}
+
+function forgetSession(name) {
+  const s = sessionIds.get(name);
+  if (s === undefined) return;
+  s.worker.sessions--;
+  sessionIds.delete(name);
+}
+
+function sendFrame(kind, s, text, onChunk) {
+  return s.worker.send(kind, s.id, text, onChunk);
+}
+
+// Results resolve to the raw JSON bytes so they can be forwarded as-is.
+// Large stdout arrives as already-escaped JSON string slices via onChunk
+// before the final result (whose stdout is then empty).
+function sendStreamingCommand(session, cmd, onChunk) {
+  return sendFrame(FRAME_STREAM, session, cmd, onChunk);
 }
 
+// Runs many commands in one backend round trip; newlines split commands.
+function sendBatch(session, cmds) {
+  return sendFrame(FRAME_BATCH, session, cmds.join("\n"));
+}
+
+// Extra origins (comma-separated) allowed to use /execute and /ws besides
+// the bridge's own
+const ALLOWED_ORIGINS = (process.env.CTERMINAL_ORIGINS || "").split(",").map((o) => o.trim()).filter((o) => o);
+
+// Browsers send Origin on every cross-site request and WebSocket handshake.
+// Only the bridge's own pages (and CTERMINAL_ORIGINS) may run commands, so
+// another site can't drive the shell from a visitor's browser. Other
+// clients send none.
+function originAllowed(req) {
+  const origin = req.headers.origin;
+  if (origin === undefined) return true;
+  if (ALLOWED_ORIGINS.includes(origin)) return true;
+  try {
+    return new URL(origin).host === req.headers.host;
+  } catch (e) {
+    return false;
+  }
+}
+
+// CORS headers for an allowed request: its own origin is echoed back
+function corsHeaders(req) {
+  const origin = req.headers.origin;
+  return origin === undefined ? { Vary: "Origin" } : { "Access-Control-Allow-Origin": origin, Vary: "Origin" };
+}
+
+// Runs one request ({session, command} or {session, commands:[...]}) and
+// hands the JSON reply to `out` in pieces: out.write(piece) while output
+// streams, then out.end(piece, status) exactly once.
+async function execute(data, out) {
+  const session = sessionFor(data.session ? String(data.session) : "");
+  try {
+    if (Array.isArray(data.commands)) {
+      const cmds = data.commands.map((c) => String(c).replace(/[\r\n]+/g, " ").trim());
+      // the backend stops a batch at its first `exit` and ends the session
+      if (cmds.includes("exit")) forgetSession(String(data.session || ""));
+      return out.end(await sendBatch(session, cmds.filter((c) => c)), 200);
+    }
+    const cmd = String(data.command || "").trim();
+    if (!cmd) return out.end(JSON.stringify({ ok: false, stderr: "empty command" }), 400);
+    // Stream big outputs straight through: open the JSON object with the
+    // stdout string, append each escaped slice, then close it with the
+    // remaining fields once the backend reports the final status.
+    let streaming = false;
+    // `exit` ends the session in the backend; forget its id too.
+    if (cmd === "exit") forgetSession(String(data.session || ""));
+    const result = await sendStreamingCommand(session, cmd, (slice) => {
+      if (!streaming) {
+        streaming = true;
+        out.write('{"stdout":"');
+      }
+      out.write(slice);
+    });
+    if (!streaming) return out.end(result, 200);
+    const rest = JSON.parse(result.toString("utf8"));
+    delete rest.stdout;
+    delete rest.streamed;
+    out.end('",' + JSON.stringify(rest).slice(1), 200);
+  } catch (e) {
+    const err = session.worker.error;
+    throw new Error(err ? "backend failed: " + String(err.message || err) : "server error");
+  }
+}
+
+// Command names for the frontend's suggestions, read from the registry the
+// backend is generated from so the two can't drift apart
+const COMMAND_NAMES = fs
+  .readFileSync(path.join(root, "backend", "commands.def"), "utf8")
+  .split("\n")
+  .map((line) => /^COMMAND\((\w+),/.exec(line))
+  .filter((m) => m)
+  .map((m) => m[1]);
+
+// The frontend is served from here too, so its WebSocket has a same-origin
+// Origin the upgrade check can accept.
+const STATIC_FILES = {
+  "/": ["index.html", "text/html; charset=utf-8"],
+  "/index.html": ["index.html", "text/html; charset=utf-8"],
+  "/script.js": ["script.js", "text/javascript; charset=utf-8"],
+  "/style.css": ["style.css", "text/css; charset=utf-8"],
+};
+
 const server = http.createServer((req, res) => {
+  const file = req.method === "GET" && STATIC_FILES[req.url];
+  if (file) {
+    return fs.readFile(path.join(root, "frontend", file[0]), (err, data) => {
+      if (err) {
+        res.writeHead(404);
+        return res.end("not found");
+      }
+      res.writeHead(200, { "Content-Type": file[1] });
+      res.end(data);
+    });
+  }
+  if (!originAllowed(req)) {
+    res.writeHead(403);
+    return res.end("forbidden");
+  }
+  const cors = corsHeaders(req);
   if (req.method === "OPTIONS") {
     res.writeHead(204, {
-      "Access-Control-Allow-Origin": "*",
+      ...cors,
       "Access-Control-Allow-Methods": "POST, OPTIONS",
       "Access-Control-Allow-Headers": "Content-Type",
     });
     return res.end();
   }
+  if (req.method === "GET" && req.url === "/commands") {
+    res.writeHead(200, { "Content-Type": "application/json", ...cors });
+    return res.end(JSON.stringify(COMMAND_NAMES));
+  }
   if (req.method !== "POST" || req.url !== "/execute") {
-    res.writeHead(404, { "Access-Control-Allow-Origin": "*" });
+    res.writeHead(404);
     return res.end("not found");
   }
-  let body = "";
-  req.on("data", (chunk) => (body += chunk.toString("utf8")));
+  const jsonHeaders = { "Content-Type": "application/json", ...cors };
+  const body = [];
+  req.on("data", (chunk) => body.push(chunk));
   req.on("end", async () => {
+    const out = {
+      write(piece) {
+        if (!res.headersSent) res.writeHead(200, jsonHeaders);
+        res.write(piece);
+      },
+      end(piece, status) {
+        if (!res.headersSent) res.writeHead(status, jsonHeaders);
+        res.end(piece);
+      },
+    };
     try {
-      const data = JSON.parse(body || "{}");
-      const cmd = (data.command || "").trim();
-      if (!cmd) {
-        res.writeHead(400, { "Access-Control-Allow-Origin": "*" });
-        return res.end(JSON.stringify({ ok: false, stderr: "empty command" }));
-      }
-      const result = await sendCommand(cmd);
-      res.writeHead(200, {
-        "Content-Type": "application/json",
-        "Access-Control-Allow-Origin": "*",
-      });
-      res.end(JSON.stringify(result));
+      await execute(JSON.parse(Buffer.concat(body).toString("utf8") || "{}"), out);
     } catch (e) {
-      res.writeHead(500, { "Access-Control-Allow-Origin": "*" });
-      res.end(
-        JSON.stringify({
-          ok: false,
-          stderr: backendError
-            ? "backend spawn failed: " + String(backendError.message || backendError)
-            : "server error",
-        })
-      );
+      if (res.headersSent) return res.destroy(e);
+      res.writeHead(500, jsonHeaders);
+      res.end(JSON.stringify({ ok: false, stderr: e instanceof SyntaxError ? "bad request" : e.message }));
+    }
+  });
+});
+
+// WebSocket channel (/ws): a persistent connection for interactive traffic (Tab completion, history
+// keys) that skips per-request HTTP setup. Client messages are
+// {id, session, command | commands}; each reply is {"id":id,"result":{...}}
+// with the same result object /execute returns. Only what the bridge needs
+// of RFC 6455 is implemented: text messages, ping/pong and close.
+const WS_GUID = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+// Largest message, counting every fragment; more closes with 1009
+const WS_MAX_MESSAGE = 64 * 1024 * 1024;
+
+class WebSocketConn {
+  constructor(socket, onMessage) {
+    this.socket = socket;
+    this.onMessage = onMessage;
+    this.queue = new ByteQueue();
+    this.fragments = [];
+    this.fragmentBytes = 0;
+    this.closed = false;
+    socket.on("data", (chunk) => this.onData(chunk));
+    socket.on("error", () => socket.destroy());
+    socket.on("close", () => (this.closed = true));
+  }
+
+  onData(chunk) {
+    const q = this.queue;
+    if (this.closed) return;
+    q.push(chunk);
+    while (q.length >= 2 && !this.closed) {
+      let head = q.peek(2);
+      // client frames must be masked (RFC 6455 5.1)
+      if (!(head[1] & 0x80)) return this.close(1002);
+      const len7 = head[1] & 0x7f;
+      const extra = len7 === 126 ? 2 : len7 === 127 ? 8 : 0;
+      const hsize = 2 + extra + 4;
+      if (q.length < hsize) return;
+      head = q.peek(hsize);
+      let len = len7;
+      if (len7 === 126) len = head.readUInt16BE(2);
+      else if (len7 === 127) len = head.readUInt32BE(2) * 0x100000000 + head.readUInt32BE(6);
+      if (len > WS_MAX_MESSAGE - this.fragmentBytes) return this.close(1009);
+      if (q.length < hsize + len) return;
+      const frame = q.take(hsize + len);
+      const mask = frame.subarray(hsize - 4, hsize);
+      const payload = frame.subarray(hsize);
+      for (let i = 0; i < payload.length; i++) payload[i] ^= mask[i & 3];
+      this.onFrame(frame[0] & 0x80, frame[0] & 0x0f, payload);
     }
+  }
+
+  onFrame(fin, opcode, payload) {
+    if (opcode === 0x8) return this.close(1000);
+    if (opcode === 0x9) return this.sendFrame(0xa, payload);
+    if (opcode === 0xa) return;
+    if (opcode !== 0x0 && opcode !== 0x1 && opcode !== 0x2) return this.close(1002);
+    this.fragments.push(payload);
+    this.fragmentBytes += payload.length;
+    if (!fin) return;
+    const message = Buffer.concat(this.fragments);
+    this.fragments = [];
+    this.fragmentBytes = 0;
+    this.onMessage(message);
+  }
+
+  sendFrame(opcode, payload) {
+    if (this.closed) return;
+    let header;
+    if (payload.length < 126) {
+      header = Buffer.from([0x80 | opcode, payload.length]);
+    } else if (payload.length < 0x10000) {
+      header = Buffer.from([0x80 | opcode, 126, 0, 0]);
+      header.writeUInt16BE(payload.length, 2);
+    } else {
+      header = Buffer.alloc(10);
+      header[0] = 0x80 | opcode;
+      header[1] = 127;
+      header.writeUInt32BE(Math.floor(payload.length / 0x100000000), 2);
+      header.writeUInt32BE(payload.length >>> 0, 6);
+    }
+    this.socket.write(header);
+    this.socket.write(payload);
+  }
+
+  send(parts) {
+    this.sendFrame(0x1, Buffer.concat(parts.map((p) => (typeof p === "string" ? Buffer.from(p) : p))));
+  }
+
+  close(code) {
+    if (this.closed) return;
+    const payload = Buffer.alloc(2);
+    payload.writeUInt16BE(code, 0);
+    this.sendFrame(0x8, payload);
+    this.closed = true;
+    this.socket.end();
+  }
+}
+
+function onSocketMessage(conn, message) {
+  let data;
+  try {
+    data = JSON.parse(message.toString("utf8"));
+  } catch (e) {
+    return;
+  }
+  const id = Number(data.id) || 0;
+  // Streamed slices are gathered and sent as one message per reply.
+  const parts = ['{"id":' + id + ',"result":'];
+  execute(data, {
+    write(piece) {
+      parts.push(piece);
+    },
+    end(piece) {
+      parts.push(piece, "}");
+      conn.send(parts);
+    },
+  }).catch((e) => {
+    conn.send([JSON.stringify({ id, result: { ok: false, stderr: e.message } })]);
   });
+}
+
+server.on("upgrade", (req, socket, head) => {
+  const key = req.headers["sec-websocket-key"];
+  if (req.url !== "/ws" || !key) return socket.destroy();
+  if (!originAllowed(req)) {
+    socket.end("HTTP/1.1 403 Forbidden\r\nConnection: close\r\n\r\n");
+    return;
+  }
+  const accept = crypto.createHash("sha1").update(key + WS_GUID).digest("base64");
+  socket.write(
+    "HTTP/1.1 101 Switching Protocols\r\n" +
+      "Upgrade: websocket\r\n" +
+      "Connection: Upgrade\r\n" +
+      "Sec-WebSocket-Accept: " + accept + "\r\n\r\n"
+  );
+  socket.setNoDelay(true);
+  const conn = new WebSocketConn(socket, (message) => onSocketMessage(conn, message));
+  // bytes that arrived together with the handshake
+  if (head && head.length) conn.onData(head);
 });
 
 server.listen(3000, () => {
   console.log("Bridge listening on http://localhost:3000");
 });
-
@@ -4,10 +4,21 @@ if not exist backend (
   echo backend directory not found
   exit /b 1
 )
-gcc -Wall -Wextra -o terminal.exe ^
+rem Perfect-hash dispatch table for the command registry
+gcc -Wall -Wextra -O2 -o tools\gen_cmdhash.exe tools\gen_cmdhash.c
+if %errorlevel% neq 0 (
+  echo Build failed
+  exit /b 1
+)
+tools\gen_cmdhash.exe backend\cmdtable.h
+if %errorlevel% neq 0 (
+  echo Build failed
+  exit /b 1
+)
+gcc -Wall -Wextra -O2 -o terminal.exe ^
   backend\main.c backend\utils.c backend\filesystem.c backend\history.c ^
   backend\stack.c backend\hashmap.c backend\parser.c backend\trie.c ^
-  backend\logger.c backend\commands.c
+  backend\logger.c backend\commands.c backend\protocol.c backend\json.c backend\session.c backend\stats.c backend\server.c backend\arena.c backend\script.c backend\dirtree.c backend\nametable.c backend\content.c
 if %errorlevel% neq 0 (
   echo Build failed
   exit /b 1
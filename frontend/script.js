@@ -26,28 +26,82 @@ let selectedAutocompleteIndex = -1;
 let isConnected = false;
 let ghostSuggestion = '';
 
-// Common commands for ghost suggestions
-const commonCommands = [
-  'mkdir', 'ls', 'cd', 'touch', 'write', 'read', 'rm', 'rmdir',
-  'cat', 'pwd', 'cp', 'mv', 'rename', 'stat', 'search', 'chmod',
-  'set', 'get', 'unset', 'listenv', 'undo', 'redo', 'history',
-  'tree', 'export', 'import', 'help', 'clear'
+// Each browser tab gets its own backend session (filesystem, history, vars)
+const sessionId = sessionStorage.getItem('cterminal-session') ||
+  Math.random().toString(36).slice(2) + Date.now().toString(36);
+sessionStorage.setItem('cterminal-session', sessionId);
+
+// Commands for ghost suggestions. loadCommandNames replaces these with the
+// backend's registry from the bridge; they only stand in until it answers.
+let commonCommands = [
+  'mkdir', 'ls', 'cd', 'touch', 'write', 'read', 'rm', 'truncate', 'rmdir',
+  'cat', 'head', 'tail', 'pwd', 'cp', 'mv', 'rename', 'stat', 'search',
+  'chmod', 'set', 'get', 'unset', 'listenv', 'undo', 'redo', 'history',
+  'tree', 'export', 'import', 'source', 'help', 'log', 'stats', 'clear'
 ];
 
 // ============================================
 // API Communication
 // ============================================
+// Served by the bridge, talk to wherever the page came from; opened as a
+// file, only HTTP works (the bridge refuses the socket's "null" origin).
+const SERVED = location.protocol === 'http:' || location.protocol === 'https:';
+const BRIDGE_URL = SERVED ? location.origin : 'http://localhost:3000';
+const SOCKET_URL = SERVED ? (location.protocol === 'https:' ? 'wss://' : 'ws://') + location.host + '/ws' : null;
+const SOCKET_RETRY_MS = 1000;
+
+// Commands go over one persistent WebSocket when it is open; replies carry
+// the id of the message they answer. Plain HTTP is the fallback.
+let socket = null;
+let socketReady = false;
+let nextMessageId = 1;
+const pendingMessages = new Map();
+
+function connectSocket() {
+  if (typeof WebSocket === 'undefined' || !SOCKET_URL) return;
+  socket = new WebSocket(SOCKET_URL);
+  socket.onopen = () => {
+    socketReady = true;
+    setConnectionStatus(true);
+  };
+  socket.onmessage = (event) => {
+    const msg = JSON.parse(event.data);
+    const waiter = pendingMessages.get(msg.id);
+    if (!waiter) return;
+    pendingMessages.delete(msg.id);
+    waiter.resolve(msg.result);
+  };
+  socket.onclose = () => {
+    socketReady = false;
+    pendingMessages.forEach(waiter => waiter.reject(new Error('Connection closed')));
+    pendingMessages.clear();
+    setTimeout(connectSocket, SOCKET_RETRY_MS);
+  };
+}
+
+function runCommandSocket(cmd) {
+  return new Promise((resolve, reject) => {
+    const id = nextMessageId++;
+    pendingMessages.set(id, { resolve, reject });
+    socket.send(JSON.stringify({ id, session: sessionId, command: cmd }));
+  });
+}
+
+async function runCommandHttp(cmd) {
+  const res = await fetch(BRIDGE_URL + '/execute', {
+    method: 'POST',
+    headers: { 'Content-Type': 'application/json' },
+    body: JSON.stringify({ session: sessionId, command: cmd }),
+  });
+  
+  if (!res.ok) throw new Error('Network error');
+  
+  return res.json();
+}
+
 async function runCommand(cmd) {
   try {
-    const res = await fetch('http://localhost:3000/execute', {
-      method: 'POST',
-      headers: { 'Content-Type': 'application/json' },
-      body: JSON.stringify({ command: cmd }),
-    });
-    
-    if (!res.ok) throw new Error('Network error');
-    
-    const data = await res.json();
+    const data = socketReady ? await runCommandSocket(cmd) : await runCommandHttp(cmd);
     setConnectionStatus(true);
     return data;
   } catch (error) {
@@ -56,6 +110,17 @@ async function runCommand(cmd) {
   }
 }
 
+async function loadCommandNames() {
+  try {
+    const res = await fetch(BRIDGE_URL + '/commands');
+    if (!res.ok) return;
+    // `clear` is handled by the frontend itself
+    commonCommands = (await res.json()).concat('clear');
+  } catch (error) {
+    // keep the built-in list
+  }
+}
+
 function setConnectionStatus(connected) {
   isConnected = connected;
   if (connected) {
@@ -516,6 +581,10 @@ async function init() {
   // Focus input
   inputEl.focus();
   
+  // Open the persistent channel; HTTP carries commands until it is up
+  connectSocket();
+  loadCommandNames();
+  
   // Test connection
   try {
     await runCommand('pwd');
@@ -0,0 +1,70 @@
+/*
+ * Build-time generator for the command dispatch table.
+ *
+ *   gen_cmdhash <out.h>
+ *
+ * Reads the registry (backend/commands.def), searches for a cmdhash()
+ * seed that maps every command name to a distinct slot, and writes the
+ * seed and slot -> registry index table to <out.h>.
+ */
+#include <stdio.h>
+#include "../backend/cmdhash.h"
+
+static const char *names[] = {
+#define COMMAND(name, min_args, flags, usage_error, help) #name,
+#include "../backend/commands.def"
+#undef COMMAND
+};
+
+#define NAME_COUNT ((int)(sizeof(names) / sizeof(names[0])))
+#define MAX_SEEDS 1000000u
+
+int main(int argc, char **argv) {
+    int size = 1;
+    int slots[1024];
+    unsigned int seed;
+    int i;
+    FILE *f;
+
+    if (argc != 2) {
+        fprintf(stderr, "usage: gen_cmdhash <out.h>\n");
+        return 1;
+    }
+    /* a table at least twice the command count keeps the search short */
+    while (size < NAME_COUNT * 2) size *= 2;
+    for (;;) {
+        for (seed = 0; seed < MAX_SEEDS; seed++) {
+            for (i = 0; i < size; i++) slots[i] = -1;
+            for (i = 0; i < NAME_COUNT; i++) {
+                unsigned int s = cmdhash(names[i], seed) & (unsigned int)(size - 1);
+                if (slots[s] >= 0) break;
+                slots[s] = i;
+            }
+            if (i == NAME_COUNT) break;
+        }
+        if (seed < MAX_SEEDS) break;
+        size *= 2;
+        if (size > 1024) {
+            fprintf(stderr, "gen_cmdhash: no perfect hash found\n");
+            return 1;
+        }
+    }
+
+    f = fopen(argv[1], "w");
+    if (!f) {
+        perror(argv[1]);
+        return 1;
+    }
+    fprintf(f, "/* Generated by tools/gen_cmdhash from backend/commands.def. Do not edit. */\n");
+    fprintf(f, "#ifndef CMDTABLE_H\n#define CMDTABLE_H\n\n");
+    fprintf(f, "#define CMD_HASH_SEED %uu\n", seed);
+    fprintf(f, "#define CMD_HASH_SIZE %d\n\n", size);
+    fprintf(f, "/* registry index of the command in each slot, or -1 */\n");
+    fprintf(f, "static const signed char cmd_hash_slots[CMD_HASH_SIZE] = {");
+    for (i = 0; i < size; i++) {
+        fprintf(f, "%s%d%s", i % 16 == 0 ? "\n    " : " ", slots[i], i + 1 < size ? "," : "\n");
+    }
+    fprintf(f, "};\n\n#endif\n");
+    fclose(f);
+    return 0;
+}